@@ -0,0 +1,267 @@
+#include "async_file_writer.h"
+
+extern "C" {
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+}
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include "my_log.h"
+#include "trace.h"
+
+// The muxer's own buffer in front of ours, packet payloads bypass it
+constexpr int kAvioBufferSize = 64 * 1024;
+constexpr size_t kBufferAlign = 4096;
+// Buffers per pwritev(), well under IOV_MAX
+constexpr int kMaxBatch = 16;
+
+AsyncFileWriter::AsyncFileWriter()
+        : fd_(-1), context_(nullptr), current_(nullptr), position_(0), size_(0), stop_(false),
+          failed_(false) {
+}
+
+AsyncFileWriter::~AsyncFileWriter() {
+    Close();
+}
+
+bool AsyncFileWriter::Open(const std::string &path, const Options &options) {
+    options_ = options;
+    options_.buffer_count = std::max(options_.buffer_count, 2);
+    options_.buffer_size = std::max<size_t>(options_.buffer_size, kBufferAlign);
+
+    fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        ILOGE("Could not open output file %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+#ifdef __linux__
+    if (options_.preallocate > 0 &&
+        fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(options_.preallocate)) < 0) {
+        // Not every filesystem can (e.g. vfat on SD cards), writing works anyway
+        ILOGW("Could not preallocate %lld bytes for %s: %s",
+              static_cast<long long>(options_.preallocate), path.c_str(), strerror(errno));
+    }
+#endif
+
+    buffers_.resize(options_.buffer_count);
+    for (auto &buffer : buffers_) {
+        void *data = nullptr;
+        if (posix_memalign(&data, kBufferAlign, options_.buffer_size) != 0) {
+            ILOGE("Could not allocate the output buffers");
+            buffer.data = nullptr;
+            Close();
+            return false;
+        }
+        buffer.data = static_cast<uint8_t *>(data);
+        buffer.size = 0;
+        buffer.offset = 0;
+        free_.push_back(&buffer);
+    }
+
+    uint8_t *avio_buffer = static_cast<uint8_t *>(av_malloc(kAvioBufferSize));
+    context_ = avio_buffer ? avio_alloc_context(avio_buffer, kAvioBufferSize, 1, this, nullptr,
+                                                WritePacket, Seek)
+                           : nullptr;
+    if (!context_) {
+        ILOGE("Could not allocate the output context");
+        av_free(avio_buffer);
+        Close();
+        return false;
+    }
+    // Large writes (packet payloads) come straight to WritePacket(), one copy less
+    context_->direct = 1;
+
+    thread_ = std::thread(&AsyncFileWriter::WriterLoop, this);
+    return true;
+}
+
+bool AsyncFileWriter::Close() {
+    if (context_) {
+        avio_flush(context_);
+        av_freep(&context_->buffer);
+        avio_context_free(&context_);
+    }
+    Submit();
+    if (thread_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        work_cv_.notify_one();
+        // The writer empties the queue before it stops
+        thread_.join();
+    }
+    if (fd_ >= 0) {
+        // Give back the reserved blocks past the end
+        if (options_.preallocate > 0 && ftruncate(fd_, static_cast<off_t>(size_)) < 0) {
+            ILOGW("Could not trim the preallocated output: %s", strerror(errno));
+        }
+        if (close(fd_) < 0) {
+            failed_ = true;
+        }
+        fd_ = -1;
+    }
+    for (auto &buffer : buffers_) {
+        free(buffer.data);
+    }
+    buffers_.clear();
+    free_.clear();
+    current_ = nullptr;
+    return !failed_.load();
+}
+
+int AsyncFileWriter::WritePacket(void *opaque, uint8_t *buf, int size) {
+    return static_cast<AsyncFileWriter *>(opaque)->Write(buf, size);
+}
+
+int64_t AsyncFileWriter::Seek(void *opaque, int64_t offset, int whence) {
+    return static_cast<AsyncFileWriter *>(opaque)->SeekTo(offset, whence);
+}
+
+int AsyncFileWriter::Write(const uint8_t *data, int size) {
+    if (failed_.load()) {
+        return AVERROR(EIO);
+    }
+    int written = 0;
+    while (written < size) {
+        if (!current_) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (free_.empty()) {
+                // Storage is a whole set of buffers behind, this is the stall
+                TRACE_SPAN("write_stall");
+                free_cv_.wait(lock, [this] { return !free_.empty(); });
+            }
+            current_ = free_.back();
+            free_.pop_back();
+            current_->size = 0;
+            current_->offset = position_;
+        }
+        size_t n = std::min(options_.buffer_size - current_->size,
+                            static_cast<size_t>(size - written));
+        memcpy(current_->data + current_->size, data + written, n);
+        current_->size += n;
+        written += static_cast<int>(n);
+        position_ += static_cast<int64_t>(n);
+        size_ = std::max(size_, position_);
+        if (current_->size == options_.buffer_size) {
+            Submit();
+        }
+    }
+    return size;
+}
+
+int64_t AsyncFileWriter::SeekTo(int64_t offset, int whence) {
+    int64_t target;
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            return size_;
+        case SEEK_SET:
+            target = offset;
+            break;
+        case SEEK_CUR:
+            target = position_ + offset;
+            break;
+        case SEEK_END:
+            target = size_ + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    if (target < 0) {
+        return AVERROR(EINVAL);
+    }
+    if (target != position_) {
+        // Whatever comes next starts a buffer of its own at the new offset
+        Submit();
+        position_ = target;
+    }
+    return target;
+}
+
+void AsyncFileWriter::Submit() {
+    if (!current_ || current_->size == 0) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queued_.push_back(current_);
+    }
+    current_ = nullptr;
+    work_cv_.notify_one();
+}
+
+void AsyncFileWriter::WriterLoop() {
+    Tracer::SetThreadName("file_writer");
+    Buffer *batch[kMaxBatch];
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        work_cv_.wait(lock, [this] { return stop_ || !queued_.empty(); });
+        if (queued_.empty()) {
+            return;
+        }
+
+        // Buffers that continue one another go out in one call
+        int count = 0;
+        int64_t end = queued_.front()->offset;
+        for (Buffer *buffer : queued_) {
+            if (count == kMaxBatch || buffer->offset != end) {
+                break;
+            }
+            batch[count++] = buffer;
+            end += static_cast<int64_t>(buffer->size);
+        }
+        lock.unlock();
+        bool ok = WriteBatch(batch, count);
+        lock.lock();
+
+        if (!ok) {
+            failed_ = true;
+        }
+        for (int i = 0; i < count; ++i) {
+            queued_.pop_front();
+            free_.push_back(batch[i]);
+        }
+        free_cv_.notify_one();
+    }
+}
+
+bool AsyncFileWriter::WriteBatch(Buffer *const *batch, int count) {
+    TRACE_SPAN("file_write");
+    struct iovec iov[kMaxBatch];
+    for (int i = 0; i < count; ++i) {
+        iov[i].iov_base = batch[i]->data;
+        iov[i].iov_len = batch[i]->size;
+    }
+
+    int64_t offset = batch[0]->offset;
+    int first = 0;
+    while (first < count) {
+        ssize_t n = pwritev(fd_, iov + first, count - first, static_cast<off_t>(offset));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ILOGE("Output write failed: %s", strerror(errno));
+            return false;
+        }
+        offset += n;
+        // Skip what went out, a short write resumes inside an iovec
+        while (first < count && static_cast<size_t>(n) >= iov[first].iov_len) {
+            n -= static_cast<ssize_t>(iov[first].iov_len);
+            ++first;
+        }
+        if (first < count) {
+            iov[first].iov_base = static_cast<uint8_t *>(iov[first].iov_base) + n;
+            iov[first].iov_len -= static_cast<size_t>(n);
+        }
+    }
+    return true;
+}
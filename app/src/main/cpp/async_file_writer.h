@@ -0,0 +1,85 @@
+#ifndef ASYNC_FILE_WRITER_H
+#define ASYNC_FILE_WRITER_H
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Output file behind a custom AVIOContext that never waits on storage
+// unless the storage falls a whole set of buffers behind.
+//
+// The muxer's writes are copied into one of a few large page-aligned
+// buffers. Full buffers go to a writer thread, which writes every queued
+// buffer that continues the previous one with a single pwritev(). Seeks (the
+// MP4 muxer patches box sizes at the end) just start a new buffer at the new
+// offset, the writer keeps the order so later data wins. When all buffers
+// are queued the muxer waits for one, which bounds memory on slow eMMC/SD.
+class AsyncFileWriter {
+ public:
+  struct Options {
+    size_t  buffer_size = 1 << 20;
+    int     buffer_count = 4;
+    // Bytes to reserve up front with fallocate(), 0 for none. Keeps the
+    // file from fragmenting and moves block allocation out of the writes.
+    int64_t preallocate = 0;
+  };
+
+  AsyncFileWriter();
+  ~AsyncFileWriter();
+
+  AsyncFileWriter(const AsyncFileWriter&) = delete;
+  AsyncFileWriter& operator=(const AsyncFileWriter&) = delete;
+
+  bool Open(const std::string& path, const Options& options);
+  // For AVFormatContext.pb, set AVFMT_FLAG_CUSTOM_IO with it
+  AVIOContext* Context() const { return context_; }
+  // Writes out everything, frees the context and closes the file.
+  // False if any write failed.
+  bool Close();
+
+ private:
+  struct Buffer {
+    uint8_t* data;
+    size_t   size;    // Bytes filled
+    int64_t  offset;  // File offset of data[0]
+  };
+
+  static int     WritePacket(void* opaque, uint8_t* buf, int size);
+  static int64_t Seek(void* opaque, int64_t offset, int whence);
+  int            Write(const uint8_t* data, int size);
+  int64_t        SeekTo(int64_t offset, int whence);
+  // Queues the buffer being filled, if it holds anything
+  void           Submit();
+  void           WriterLoop();
+  // pwritev() the batch, false on error
+  bool           WriteBatch(Buffer* const* batch, int count);
+
+  int                  fd_;
+  AVIOContext*         context_;
+  Options              options_;
+  std::vector<Buffer>  buffers_;
+  Buffer*              current_;   // Being filled by the muxer, not queued
+  int64_t              position_;  // Muxer's write position
+  int64_t              size_;      // End of the furthest write
+
+  std::thread             thread_;
+  std::mutex              mutex_;
+  std::condition_variable work_cv_;   // Wakes the writer
+  std::condition_variable free_cv_;   // A buffer was written and is free again
+  std::deque<Buffer*>     queued_;    // Guarded by mutex_
+  std::vector<Buffer*>    free_;      // Guarded by mutex_
+  bool                    stop_;      // Guarded by mutex_
+  std::atomic<bool>       failed_;
+};
+
+#endif /* ASYNC_FILE_WRITER_H */
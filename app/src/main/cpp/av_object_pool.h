@@ -0,0 +1,85 @@
+#ifndef AV_OBJECT_POOL_H
+#define AV_OBJECT_POOL_H
+
+extern "C" {
+#include <libavcodec/packet.h>
+#include <libavutil/frame.h>
+}
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// Recycles AVFrame / AVPacket structs. av_frame_alloc() and av_frame_free()
+// per frame cost a malloc and a free each; Put() unreferences the object's
+// buffers and keeps the empty struct for the next Get() instead. Up to
+// capacity structs are kept, the free list is reserved up front so Put()
+// does not allocate either. Thread-safe, load workers take frames while
+// the encode thread hands them back.
+template <typename T, T* (*Alloc)(), void (*Unref)(T*), void (*Free)(T**)>
+class AVObjectPool {
+ public:
+  AVObjectPool() : capacity_(0) {}
+  ~AVObjectPool() {
+    for (T* object : free_) {
+      Free(&object);
+    }
+  }
+
+  AVObjectPool(const AVObjectPool&) = delete;
+  AVObjectPool& operator=(const AVObjectPool&) = delete;
+
+  // Allocates the structs now and keeps up to capacity of them from then on
+  void Reserve(size_t capacity) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = capacity;
+    free_.reserve(capacity);
+    while (free_.size() < capacity) {
+      T* object = Alloc();
+      if (!object) {
+        break;
+      }
+      free_.push_back(object);
+    }
+  }
+
+  // nullptr only if the pool is empty and allocating a new one failed
+  T* Get() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!free_.empty()) {
+        T* object = free_.back();
+        free_.pop_back();
+        return object;
+      }
+    }
+    return Alloc();
+  }
+
+  // Takes any object of the type, also ones not from Get(). Clears *object.
+  void Put(T*& object) {
+    if (!object) {
+      return;
+    }
+    Unref(object);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (free_.size() < capacity_) {
+        free_.push_back(object);
+        object = nullptr;
+        return;
+      }
+    }
+    Free(&object);
+  }
+
+ private:
+  std::mutex      mutex_;
+  std::vector<T*> free_;
+  size_t          capacity_;
+};
+
+using AVFramePool = AVObjectPool<AVFrame, av_frame_alloc, av_frame_unref, av_frame_free>;
+using AVPacketPool = AVObjectPool<AVPacket, av_packet_alloc, av_packet_unref, av_packet_free>;
+
+#endif /* AV_OBJECT_POOL_H */
@@ -0,0 +1,92 @@
+#include "alloc_counter.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+
+namespace {
+
+std::atomic<bool>    g_enabled(false);
+std::atomic<int64_t> g_count(0);
+
+inline void CountAllocation() {
+    if (g_enabled.load(std::memory_order_relaxed)) {
+        g_count.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+}  // namespace
+
+#if defined(__GLIBC__)
+
+// glibc's own entry points, the wrappers below forward to them
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void  __libc_free(void* ptr);
+
+void* malloc(size_t size) {
+    CountAllocation();
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    CountAllocation();
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    CountAllocation();
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+    __libc_free(ptr);
+}
+
+// av_malloc() goes through posix_memalign()
+int posix_memalign(void** out, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    CountAllocation();
+    void* ptr = __libc_memalign(alignment, size);
+    if (!ptr && size != 0) {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    CountAllocation();
+    return __libc_memalign(alignment, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    CountAllocation();
+    return __libc_memalign(alignment, size);
+}
+}
+
+bool alloc_counter::Supported() {
+    return true;
+}
+
+#else
+
+bool alloc_counter::Supported() {
+    return false;
+}
+
+#endif
+
+void alloc_counter::Enable(bool enable) {
+    g_enabled.store(enable, std::memory_order_relaxed);
+}
+
+int64_t alloc_counter::Count() {
+    return g_count.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,20 @@
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+#include <cstdint>
+
+// Benchmark-only heap allocation counter. The bench binary replaces malloc
+// and friends with counting wrappers around glibc's allocator, which also
+// catches allocations made inside the FFmpeg shared libraries. Counting is
+// off until enabled and costs one relaxed load per allocation then.
+namespace alloc_counter {
+
+// False where the wrappers are not built (non-glibc hosts)
+bool Supported();
+void Enable(bool enable);
+// Allocations (malloc, calloc, realloc, aligned variants) counted so far
+int64_t Count();
+
+}  // namespace alloc_counter
+
+#endif /* ALLOC_COUNTER_H */
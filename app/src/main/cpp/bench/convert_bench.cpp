@@ -0,0 +1,264 @@
+#include "convert_bench.h"
+
+#include "nv12_convert.h"
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+}
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+namespace convert_bench {
+
+namespace {
+
+// neon or avx2/sse4.1, plus the scalar reference
+constexpr int kMaxKernels = 4;
+// The flags ConvertFrame() used for this conversion before the kernels
+constexpr int kSwsFlags = SWS_FAST_BILINEAR;
+constexpr int kTimingWarmup = 5;
+
+struct Size {
+  int width;
+  int height;
+};
+
+// Odd widths go through the kernels' scalar tail, odd heights pair the last
+// row with itself
+constexpr Size kCheckSizes[] = {{800, 1280}, {640, 480}, {97, 61}, {33, 17},
+                                {31, 2},     {17, 33},  {3, 3},   {2, 2}};
+
+enum class Pattern { kRandom, kBlack, kWhite, kBlue, kGreen, kRed, kChecker, kStripes };
+
+constexpr Pattern kPatterns[] = {Pattern::kRandom, Pattern::kBlack,   Pattern::kWhite,
+                                 Pattern::kBlue,   Pattern::kGreen,   Pattern::kRed,
+                                 Pattern::kChecker, Pattern::kStripes};
+
+const char* PatternName(Pattern pattern) {
+    switch (pattern) {
+        case Pattern::kRandom: return "random";
+        case Pattern::kBlack: return "black";
+        case Pattern::kWhite: return "white";
+        case Pattern::kBlue: return "blue";
+        case Pattern::kGreen: return "green";
+        case Pattern::kRed: return "red";
+        case Pattern::kChecker: return "checker";
+        case Pattern::kStripes: return "stripes";
+    }
+    return "?";
+}
+
+uint8_t NextRandom(uint32_t& state) {
+    // xorshift32, the same frames on every run
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return static_cast<uint8_t>(state >> 24);
+}
+
+void Fill(AVFrame* frame, Pattern pattern, uint32_t seed) {
+    uint32_t state = seed | 1;
+    for (int y = 0; y < frame->height; ++y) {
+        uint8_t* bgr = frame->data[0] + y * frame->linesize[0];
+        for (int x = 0; x < frame->width; ++x, bgr += 3) {
+            uint8_t b = 0, g = 0, r = 0;
+            switch (pattern) {
+                case Pattern::kRandom:
+                    b = NextRandom(state);
+                    g = NextRandom(state);
+                    r = NextRandom(state);
+                    break;
+                case Pattern::kBlack:
+                    break;
+                case Pattern::kWhite:
+                    b = g = r = 255;
+                    break;
+                case Pattern::kBlue:
+                    b = 255;
+                    break;
+                case Pattern::kGreen:
+                    g = 255;
+                    break;
+                case Pattern::kRed:
+                    r = 255;
+                    break;
+                case Pattern::kChecker:
+                    // Every 2x2 block averages full black and full white
+                    b = g = r = ((x ^ y) & 1) ? 255 : 0;
+                    break;
+                case Pattern::kStripes:
+                    // Saturated red and blue side by side, the widest chroma swing
+                    b = (x & 1) ? 255 : 0;
+                    r = (x & 1) ? 0 : 255;
+                    break;
+            }
+            bgr[0] = b;
+            bgr[1] = g;
+            bgr[2] = r;
+        }
+    }
+}
+
+AVFrame* NewFrame(AVPixelFormat format, int width, int height) {
+    AVFrame* frame = av_frame_alloc();
+    if (!frame) {
+        return nullptr;
+    }
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 0) < 0) {
+        av_frame_free(&frame);
+    }
+    return frame;
+}
+
+// Largest difference between the first row_bytes of rows rows of a plane
+int MaxDiff(const AVFrame* a, const AVFrame* b, int plane, int row_bytes, int rows) {
+    int max_diff = 0;
+    for (int y = 0; y < rows; ++y) {
+        const uint8_t* pa = a->data[plane] + y * a->linesize[plane];
+        const uint8_t* pb = b->data[plane] + y * b->linesize[plane];
+        for (int x = 0; x < row_bytes; ++x) {
+            max_diff = std::max(max_diff, std::abs(pa[x] - pb[x]));
+        }
+    }
+    return max_diff;
+}
+
+void Convert(const Bgr24ToNv12Kernel& kernel, const AVFrame* src, AVFrame* dst) {
+    Bgr24ToNv12With(kernel.row_pair, src->data[0], src->linesize[0], dst->data[0],
+                    dst->linesize[0], dst->data[1], dst->linesize[1], src->width, src->height);
+}
+
+template <typename Fn>
+double MsPerFrame(int frames, const Fn& fn) {
+    for (int i = 0; i < kTimingWarmup; ++i) {
+        fn();
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; ++i) {
+        fn();
+    }
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+                   .count() / frames;
+}
+
+// Compares every kernel with swscale on every pattern at one size
+bool CheckSize(const Bgr24ToNv12Kernel* kernels, int count, Size size, bool verbose) {
+    AVFrame* src = NewFrame(AV_PIX_FMT_BGR24, size.width, size.height);
+    AVFrame* ref = NewFrame(AV_PIX_FMT_NV12, size.width, size.height);
+    AVFrame* out = NewFrame(AV_PIX_FMT_NV12, size.width, size.height);
+    SwsContext* sws = sws_getContext(size.width, size.height, AV_PIX_FMT_BGR24, size.width,
+                                     size.height, AV_PIX_FMT_NV12, kSwsFlags, nullptr, nullptr,
+                                     nullptr);
+    bool ok = src && ref && out && sws;
+    if (!ok) {
+        fprintf(stderr, "convert check: could not set up %dx%d\n", size.width, size.height);
+    }
+
+    int chroma_bytes = (size.width + 1) / 2 * 2;
+    int chroma_rows = (size.height + 1) / 2;
+    for (Pattern pattern : kPatterns) {
+        if (!ok) {
+            break;
+        }
+        Fill(src, pattern, static_cast<uint32_t>(size.width * 131 + size.height * 7) +
+                           static_cast<uint32_t>(pattern));
+        if (sws_scale_frame(sws, ref, src) < 0) {
+            fprintf(stderr, "convert check: swscale failed at %dx%d\n", size.width, size.height);
+            ok = false;
+            break;
+        }
+        for (int k = 0; k < count; ++k) {
+            Convert(kernels[k], src, out);
+            int luma = MaxDiff(ref, out, 0, size.width, size.height);
+            int chroma = MaxDiff(ref, out, 1, chroma_bytes, chroma_rows);
+            bool match = luma <= 1 && chroma <= 1;
+            if (!match || verbose) {
+                fprintf(match ? stdout : stderr, "%-7s %4dx%-4d %-8s luma %d, chroma %d off%s\n",
+                        kernels[k].name, size.width, size.height, PatternName(pattern), luma,
+                        chroma, match ? "" : ", more than 1");
+            }
+            ok = ok && match;
+        }
+    }
+
+    sws_freeContext(sws);
+    av_frame_free(&out);
+    av_frame_free(&ref);
+    av_frame_free(&src);
+    return ok;
+}
+
+}  // namespace
+
+bool Check(bool verbose) {
+    Bgr24ToNv12Kernel kernels[kMaxKernels];
+    int count = Bgr24ToNv12Kernels(kernels, kMaxKernels);
+
+    bool ok = true;
+    for (Size size : kCheckSizes) {
+        ok = CheckSize(kernels, count, size, verbose) && ok;
+    }
+
+    printf("convert check %s:", ok ? "passed" : "FAILED");
+    for (int k = 0; k < count; ++k) {
+        printf(" %s", kernels[k].name);
+    }
+    printf(" against swscale, %zu sizes x %zu patterns, within 1\n",
+           sizeof(kCheckSizes) / sizeof(kCheckSizes[0]), sizeof(kPatterns) / sizeof(kPatterns[0]));
+    return ok;
+}
+
+bool Time(int width, int height, int frames, bool json) {
+    Bgr24ToNv12Kernel kernels[kMaxKernels];
+    int count = Bgr24ToNv12Kernels(kernels, kMaxKernels);
+
+    AVFrame* src = NewFrame(AV_PIX_FMT_BGR24, width, height);
+    AVFrame* dst = NewFrame(AV_PIX_FMT_NV12, width, height);
+    // sws_getContext() leaves swscale at one thread, like the kernels here
+    SwsContext* sws = sws_getContext(width, height, AV_PIX_FMT_BGR24, width, height,
+                                     AV_PIX_FMT_NV12, kSwsFlags, nullptr, nullptr, nullptr);
+    bool ok = src && dst && sws;
+    if (!ok) {
+        fprintf(stderr, "convert timing: could not set up %dx%d\n", width, height);
+    } else {
+        Fill(src, Pattern::kRandom, 1);
+        double sws_ms = MsPerFrame(frames, [&]() { sws_scale_frame(sws, dst, src); });
+        double kernel_ms[kMaxKernels];
+        for (int k = 0; k < count; ++k) {
+            kernel_ms[k] = MsPerFrame(frames, [&]() { Convert(kernels[k], src, dst); });
+        }
+
+        if (json) {
+            printf("{\"convert\":{\"width\":%d,\"height\":%d,\"frames\":%d,\"swscale_ms\":%.4f,"
+                   "\"kernels\":{", width, height, frames, sws_ms);
+            for (int k = 0; k < count; ++k) {
+                printf("%s\"%s\":{\"ms\":%.4f,\"speedup\":%.2f}", k > 0 ? "," : "",
+                       kernels[k].name, kernel_ms[k], sws_ms / kernel_ms[k]);
+            }
+            printf("}}}\n");
+        } else {
+            printf("convert      BGR24 -> NV12 %dx%d, %d frames, one thread\n", width, height,
+                   frames);
+            printf("  swscale    %.3f ms/frame\n", sws_ms);
+            for (int k = 0; k < count; ++k) {
+                printf("  %-10s %.3f ms/frame, %.2fx swscale\n", kernels[k].name, kernel_ms[k],
+                       sws_ms / kernel_ms[k]);
+            }
+        }
+    }
+
+    sws_freeContext(sws);
+    av_frame_free(&dst);
+    av_frame_free(&src);
+    return ok;
+}
+
+}  // namespace convert_bench
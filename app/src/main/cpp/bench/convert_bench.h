@@ -0,0 +1,20 @@
+#ifndef CONVERT_BENCH_H
+#define CONVERT_BENCH_H
+
+// BGR24 -> NV12 kernel checks for the benchmark, against what the kernels
+// replace: sws_scale() with SWS_FAST_BILINEAR at the same size.
+namespace convert_bench {
+
+// Converts random and edge-value frames, odd sizes included, with every
+// kernel the CPU can run. False if any output byte is more than 1 off the
+// swscale result.
+bool Check(bool verbose);
+
+// Conversion-only timing of every kernel and of swscale, single-threaded,
+// in ms per frame over the given number of frames. False if swscale could
+// not be set up.
+bool Time(int width, int height, int frames, bool json);
+
+}  // namespace convert_bench
+
+#endif /* CONVERT_BENCH_H */
@@ -0,0 +1,460 @@
+// Off-device benchmark for FFmpegEncoder, see CMakeLists.txt in this directory.
+//
+// Encodes a directory of raw BGR24 frames or JPEG images and reports
+// throughput, per-frame latency percentiles, output size and peak RSS,
+// as text or as a single JSON object on stdout.
+
+#include "alloc_counter.h"
+#include "convert_bench.h"
+#include "ffmpeg_encoder.h"
+#include "jpeg_decoder.h"
+#include "raw_frame_loader.h"
+#include "trace.h"
+
+extern "C" {
+#include <libavutil/log.h>
+}
+
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Options {
+  std::string input;
+  std::string set;
+  std::string output = "encoder_bench.mp4";
+  std::string encoder = "libx264";
+  std::string trace;
+  int         width = 0;
+  int         height = 0;
+  int         fps = 30;
+  int         quality = 4;
+  int         frames = 0;  // 0 = every input file
+  int         bands = 0;
+  int         threads = 0;
+  int         warmup = -1;  // -1 = a third of the frames
+  int         max_allocs = -1;
+  bool        count_allocs = false;
+  bool        drain_thread = false;
+  bool        unbuffered_output = false;
+  int         fragment_ms = 0;
+  bool        annexb = false;
+  double      target_fps = 0;
+  bool        live = false;
+  int         downscale_at = -1;  // Frame to switch to half size at, -1 = never
+  double      segment_s = 0;
+  int64_t     segment_bytes = 0;
+  std::string playlist;
+  bool        check_convert = false;
+  bool        convert_only = false;
+  bool        json = false;
+  bool        verbose = false;
+};
+
+void Usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s (--input DIR | --set raw|jpeg) [options]\n"
+            "       %s --check-convert [--verbose]\n"
+            "       %s --convert-only [--width W --height H --frames N --json]\n"
+            "  --input DIR       encode the .raw/.jpg files of DIR in name order\n"
+            "  --set raw|jpeg    encode one of the bundled assets/images sets\n"
+            "  --width W --height H  raw frame size (raw set: 800x1280)\n"
+            "  --encoder NAME    libx264 (default), mediacodec, nvenc, vaapi\n"
+            "  --output FILE     output file (default encoder_bench.mp4)\n"
+            "  --fps N --quality N --frames N\n"
+            "  --bands N         conversion bands, 0 = one per core\n"
+            "  --threads N       codec threads, 0 = FFmpeg default\n"
+            "  --drain-thread    write packets from the encoder's drain thread\n"
+            "  --unbuffered-output  write the file with avio_open(), not AsyncFileWriter\n"
+            "  --fragment-ms N   write fragmented MP4 with N ms fragments\n"
+            "  --annexb          write a raw H.264 Annex-B stream, no muxer\n"
+            "  --target-fps N    tune the libx264 preset and threads to encode N fps\n"
+            "  --live            low-latency live mode, counts frames over 50 ms\n"
+            "  --downscale-at N  switch the output to half size at frame N\n"
+            "  --segment-s N     roll to a new output file every N seconds\n"
+            "  --segment-bytes N roll to a new output file every N bytes\n"
+            "  --playlist FILE   keep an HLS playlist of the segments\n"
+            "  --trace FILE      write a Chrome trace of the encoder stages\n"
+            "  --count-allocs    count heap allocations per frame after warm-up, on the\n"
+            "                    serial path with one codec thread and unbuffered output\n"
+            "  --warmup N        frames before the steady state (default a third)\n"
+            "  --max-allocs-per-frame N  fail if the steady state allocates more\n"
+            "  --check-convert   compare every BGR24 -> NV12 kernel with swscale, within 1\n"
+            "  --convert-only    time the kernels against swscale (default 800x1280)\n"
+            "  --json            print the results as JSON\n"
+            "  --verbose         keep FFmpeg logging at info level\n",
+            argv0, argv0, argv0);
+}
+
+bool ParseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> const char* { return i + 1 < argc ? argv[++i] : nullptr; };
+        const char* v = nullptr;
+        if (arg == "--json") {
+            options.json = true;
+        } else if (arg == "--verbose") {
+            options.verbose = true;
+        } else if (arg == "--drain-thread") {
+            options.drain_thread = true;
+        } else if (arg == "--live") {
+            options.live = true;
+        } else if (arg == "--annexb") {
+            options.annexb = true;
+        } else if (arg == "--unbuffered-output") {
+            options.unbuffered_output = true;
+        } else if (arg == "--check-convert") {
+            options.check_convert = true;
+        } else if (arg == "--convert-only") {
+            options.convert_only = true;
+        } else if (arg == "--count-allocs") {
+            options.count_allocs = true;
+        } else if (arg == "--target-fps" && (v = value())) {
+            options.target_fps = atof(v);
+        } else if (arg == "--segment-s" && (v = value())) {
+            options.segment_s = atof(v);
+        } else if (arg == "--segment-bytes" && (v = value())) {
+            options.segment_bytes = atoll(v);
+        } else if (arg == "--playlist" && (v = value())) {
+            options.playlist = v;
+        } else if (arg == "--downscale-at" && (v = value())) {
+            options.downscale_at = atoi(v);
+        } else if (arg == "--fragment-ms" && (v = value())) {
+            options.fragment_ms = atoi(v);
+        } else if (arg == "--warmup" && (v = value())) {
+            options.warmup = atoi(v);
+        } else if (arg == "--max-allocs-per-frame" && (v = value())) {
+            options.max_allocs = atoi(v);
+            options.count_allocs = true;
+        } else if (arg == "--input" && (v = value())) {
+            options.input = v;
+        } else if (arg == "--set" && (v = value())) {
+            options.set = v;
+        } else if (arg == "--output" && (v = value())) {
+            options.output = v;
+        } else if (arg == "--trace" && (v = value())) {
+            options.trace = v;
+        } else if (arg == "--encoder" && (v = value())) {
+            options.encoder = v;
+        } else if (arg == "--width" && (v = value())) {
+            options.width = atoi(v);
+        } else if (arg == "--height" && (v = value())) {
+            options.height = atoi(v);
+        } else if (arg == "--fps" && (v = value())) {
+            options.fps = atoi(v);
+        } else if (arg == "--quality" && (v = value())) {
+            options.quality = atoi(v);
+        } else if (arg == "--frames" && (v = value())) {
+            options.frames = atoi(v);
+        } else if (arg == "--bands" && (v = value())) {
+            options.bands = atoi(v);
+        } else if (arg == "--threads" && (v = value())) {
+            options.threads = atoi(v);
+        } else {
+            return false;
+        }
+    }
+    if (options.check_convert || options.convert_only) {
+        return options.input.empty() && options.set.empty();
+    }
+    return options.input.empty() != options.set.empty();
+}
+
+bool ParseEncoderType(const std::string& name, FFmpegEncoder::EncoderType& type) {
+    if (name == "libx264") {
+        type = FFmpegEncoder::EncoderType::LIBX264;
+    } else if (name == "mediacodec") {
+        type = FFmpegEncoder::EncoderType::MEDIACODEC;
+    } else if (name == "nvenc") {
+        type = FFmpegEncoder::EncoderType::NVENC;
+    } else if (name == "vaapi") {
+        type = FFmpegEncoder::EncoderType::VAAPI;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool EndsWith(const std::string& s, const char* suffix) {
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+bool IsRaw(const std::string& path) {
+    return EndsWith(path, ".raw");
+}
+
+// Leading frame number first, so "10_x.raw" sorts after "9_x.raw"
+bool NaturalLess(const std::string& a, const std::string& b) {
+    long na = strtol(a.c_str(), nullptr, 10);
+    long nb = strtol(b.c_str(), nullptr, 10);
+    return na != nb ? na < nb : a < b;
+}
+
+std::vector<std::string> ListImages(const std::string& dir, const std::string& set) {
+    std::vector<std::string> names;
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        return names;
+    }
+    while (dirent* entry = readdir(d)) {
+        std::string name = entry->d_name;
+        bool raw = IsRaw(name);
+        bool jpeg = EndsWith(name, ".jpg") || EndsWith(name, ".jpeg");
+        if ((set.empty() && (raw || jpeg)) || (set == "raw" && raw) || (set == "jpeg" && jpeg)) {
+            names.push_back(name);
+        }
+    }
+    closedir(d);
+
+    std::sort(names.begin(), names.end(), NaturalLess);
+    for (auto& name : names) {
+        name = dir + "/" + name;
+    }
+    return names;
+}
+
+AVFrame* LoadRaw(const std::string& path, int width, int height) {
+    AVBufferRef* buffer = MapRawFrame(path, static_cast<size_t>(width) * height * 3);
+    if (!buffer) {
+        return nullptr;
+    }
+    AVFrame* frame = av_frame_alloc();
+    if (!frame) {
+        av_buffer_unref(&buffer);
+        return nullptr;
+    }
+    frame->buf[0] = buffer;
+    av_image_fill_arrays(frame->data, frame->linesize, buffer->data, AV_PIX_FMT_BGR24,
+                         width, height, 1);
+    frame->format = AV_PIX_FMT_BGR24;
+    frame->width = width;
+    frame->height = height;
+    return frame;
+}
+
+void ReleaseFrame(void* opaque, uint8_t*) {
+    AVFrame* frame = static_cast<AVFrame*>(opaque);
+    av_frame_free(&frame);
+}
+
+double Percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    // Nearest rank
+    size_t rank = static_cast<size_t>(p / 100.0 * sorted.size() + 0.5);
+    return sorted[std::min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+std::string JsonEscape(const std::string& s) {
+    std::string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    FFmpegEncoder::EncoderType encoder_type;
+    if (!ParseOptions(argc, argv, options) || !ParseEncoderType(options.encoder, encoder_type)) {
+        Usage(argv[0]);
+        return 2;
+    }
+    if (options.check_convert || options.convert_only) {
+        av_log_set_level(options.verbose ? AV_LOG_INFO : AV_LOG_ERROR);
+        bool ok = !options.check_convert || convert_bench::Check(options.verbose);
+        if (options.convert_only) {
+            ok = convert_bench::Time(options.width > 0 ? options.width : 800,
+                                     options.height > 0 ? options.height : 1280,
+                                     options.frames > 0 ? options.frames : 200, options.json) &&
+                 ok;
+        }
+        return ok ? 0 : 1;
+    }
+
+    std::string dir = options.input.empty() ? std::string(BENCH_ASSETS_DIR) : options.input;
+    std::vector<std::string> images = ListImages(dir, options.set);
+    if (options.frames > 0 && images.size() > static_cast<size_t>(options.frames)) {
+        images.resize(options.frames);
+    }
+    if (images.empty()) {
+        fprintf(stderr, "no input images in %s\n", dir.c_str());
+        return 1;
+    }
+
+    // Raw frames carry no size, JPEGs are sized by the first image
+    JpegDecoder decoder;
+    if (options.set == "raw" && options.width == 0 && options.height == 0) {
+        options.width = 800;
+        options.height = 1280;
+    }
+    if (!IsRaw(images[0]) && (options.width == 0 || options.height == 0)) {
+        AVFrame* first = decoder.Decode(images[0]);
+        if (!first) {
+            fprintf(stderr, "could not decode %s\n", images[0].c_str());
+            return 1;
+        }
+        options.width = first->width;
+        options.height = first->height;
+        av_frame_free(&first);
+    }
+    if (options.width <= 0 || options.height <= 0) {
+        fprintf(stderr, "raw input needs --width and --height\n");
+        return 2;
+    }
+
+    if (options.count_allocs && !alloc_counter::Supported()) {
+        fprintf(stderr, "allocation counting needs glibc\n");
+        return 2;
+    }
+    if (options.count_allocs) {
+        // The counter is process-wide. Only work done inside EncodeFrame() may run while
+        // it counts, so no drain or writer thread and no codec threads finishing later.
+        if (options.drain_thread || options.threads > 1) {
+            fprintf(stderr, "allocation counting runs without --drain-thread and --threads > 1\n");
+            return 2;
+        }
+        options.unbuffered_output = true;
+        options.threads = 1;
+    }
+    size_t warmup = options.warmup >= 0 ? static_cast<size_t>(options.warmup) : images.size() / 3;
+    int64_t steady_allocs = 0;
+    size_t steady_frames = 0;
+
+    Tracer::Enable(!options.trace.empty());
+    std::vector<double> latencies_ms;
+    latencies_ms.reserve(images.size());
+    int failed = 0;
+    EncoderStats stats = {};
+    auto start = std::chrono::steady_clock::now();
+    {
+        FFmpegEncoder encoder(encoder_type, options.width, options.height, options.quality,
+                              options.fps);
+        // The constructor turns FFmpeg logging up to trace
+        av_log_set_level(options.verbose ? AV_LOG_INFO : AV_LOG_ERROR);
+        encoder.SetConvertBands(options.bands);
+        encoder.SetCodecThreads(options.threads);
+        encoder.SetDrainThread(options.drain_thread);
+        encoder.SetBufferedOutput(!options.unbuffered_output);
+        encoder.SetFragmentedOutput(options.fragment_ms);
+        encoder.SetAnnexBOutput(options.annexb);
+        encoder.SetTargetFps(options.target_fps);
+        encoder.SetLiveMode(options.live);
+        encoder.SetSegmentedOutput(options.segment_s, options.segment_bytes, options.playlist);
+        // Preallocates the file like a recording of known length would
+        encoder.SetExpectedDuration(static_cast<double>(images.size()) / options.fps);
+        if (!encoder.Initialize(options.output)) {
+            fprintf(stderr, "could not initialize the %s encoder\n", options.encoder.c_str());
+            return 1;
+        }
+
+        for (size_t i = 0; i < images.size(); ++i) {
+            const std::string& img = images[i];
+            auto frame_start = std::chrono::steady_clock::now();
+            if (static_cast<int>(i) == options.downscale_at) {
+                // Rounded down to even, 4:2:0 needs it
+                encoder.SetResolution(options.width / 4 * 2, options.height / 4 * 2);
+            }
+            AVFrame* frame = IsRaw(img) ? LoadRaw(img, options.width, options.height)
+                                        : decoder.Decode(img);
+            // Only the encoder is counted, loading the input is the bench's own
+            bool counted = options.count_allocs && i >= warmup;
+            int64_t allocs_before = alloc_counter::Count();
+            alloc_counter::Enable(counted);
+            bool ok = frame && encoder.EncodeFrame(frame->data, frame->linesize,
+                                                   static_cast<AVPixelFormat>(frame->format),
+                                                   frame->width, frame->height, AV_NOPTS_VALUE,
+                                                   ReleaseFrame, frame);
+            alloc_counter::Enable(false);
+            if (counted) {
+                steady_allocs += alloc_counter::Count() - allocs_before;
+                steady_frames++;
+            }
+            latencies_ms.push_back(std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - frame_start).count());
+            if (!ok) {
+                failed++;
+            }
+        }
+        encoder.Flush();
+        stats = encoder.GetStats();
+        // The trailer is written when the encoder goes out of scope
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (!options.trace.empty() && !Tracer::WriteChromeTrace(options.trace)) {
+        fprintf(stderr, "could not write the trace to %s\n", options.trace.c_str());
+    }
+
+    std::sort(latencies_ms.begin(), latencies_ms.end());
+    struct stat st = {};
+    long long bytes = stat(options.output.c_str(), &st) == 0 ? static_cast<long long>(st.st_size) : 0;
+    if (options.segment_s > 0 || options.segment_bytes > 0) {
+        // Spread over the segment files, no container overhead counted
+        bytes = stats.bytes_muxed;
+    }
+    struct rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    long peak_rss_kb = usage.ru_maxrss;  // kilobytes on Linux
+    double fps = seconds > 0 ? images.size() / seconds : 0;
+    double allocs_per_frame = steady_frames > 0 ? static_cast<double>(steady_allocs) / steady_frames
+                                                : 0;
+
+    if (options.json) {
+        printf("{\"encoder\":\"%s\",\"input\":\"%s\",\"width\":%d,\"height\":%d,"
+               "\"frames\":%zu,\"failed\":%d,\"seconds\":%.3f,\"fps\":%.2f,"
+               "\"latency_ms\":{\"p50\":%.3f,\"p95\":%.3f,\"p99\":%.3f,\"max\":%.3f},"
+               "\"packets\":%lld,\"keyframes\":%lld,\"dropped\":%lld,"
+               "\"allocs_per_frame\":%.2f,\"bytes_written\":%lld,\"peak_rss_kb\":%ld}\n",
+               options.encoder.c_str(), JsonEscape(dir).c_str(), options.width, options.height,
+               images.size(), failed, seconds, fps, Percentile(latencies_ms, 50),
+               Percentile(latencies_ms, 95), Percentile(latencies_ms, 99), latencies_ms.back(),
+               static_cast<long long>(stats.packets_muxed), static_cast<long long>(stats.keyframes),
+               static_cast<long long>(stats.frames_dropped),
+               options.count_allocs ? allocs_per_frame : -1.0, bytes, peak_rss_kb);
+    } else {
+        printf("encoder      %s %dx%d\n", options.encoder.c_str(), options.width, options.height);
+        printf("frames       %zu (%d failed) from %s\n", images.size(), failed, dir.c_str());
+        printf("throughput   %.2f fps (%.3f s)\n", fps, seconds);
+        printf("latency      p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+               Percentile(latencies_ms, 50), Percentile(latencies_ms, 95),
+               Percentile(latencies_ms, 99), latencies_ms.back());
+        printf("packets      %lld (%lld keyframes), %lld frames dropped\n",
+               static_cast<long long>(stats.packets_muxed), static_cast<long long>(stats.keyframes),
+               static_cast<long long>(stats.frames_dropped));
+        printf("submit->pkt  mean %.3f ms, p99 < %.0f ms, first %.3f ms\n", stats.MeanLatencyMs(),
+               stats.LatencyPercentileMs(99), stats.latency_first_us / 1000.0);
+        if (options.live) {
+            printf("late frames  %lld over 50 ms\n", static_cast<long long>(stats.late_frames));
+        }
+        if (options.count_allocs) {
+            printf("allocations  %.2f per frame over %zu steady-state frames\n", allocs_per_frame,
+                   steady_frames);
+        }
+        printf("written      %lld bytes to %s\n", bytes, options.output.c_str());
+        printf("peak rss     %ld KiB\n", peak_rss_kb);
+    }
+    if (options.max_allocs >= 0 && allocs_per_frame > options.max_allocs) {
+        fprintf(stderr, "%.2f allocations per frame, more than the allowed %d\n", allocs_per_frame,
+                options.max_allocs);
+        return 1;
+    }
+    return failed == 0 ? 0 : 1;
+}
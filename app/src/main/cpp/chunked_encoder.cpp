@@ -0,0 +1,245 @@
+#include "chunked_encoder.h"
+
+#include <algorithm>
+#include <thread>
+
+#include "my_log.h"
+
+ChunkedEncoder::ChunkedEncoder(FFmpegEncoder::EncoderType encoder_type, int width, int height,
+                               int quality, int fps, int instances)
+        : encoder_type_(encoder_type), width_(width), height_(height), quality_(quality),
+          fps_(fps), instances_(instances), codec_threads_(1), format_context_(nullptr),
+          video_stream_(nullptr), next_chunk_(0), next_write_(0), window_(0), abort_(false) {
+    int cores = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    if (instances_ <= 0) {
+        instances_ = cores;
+    }
+    // The instances split the cores, libx264 would otherwise size every one for all of them
+    codec_threads_ = std::max(1, cores / instances_);
+}
+
+ChunkedEncoder::~ChunkedEncoder() {
+    CloseOutput();
+}
+
+FFmpegEncoder *ChunkedEncoder::CreateEncoder() {
+    std::unique_ptr<FFmpegEncoder> encoder(
+            new FFmpegEncoder(encoder_type_, width_, height_, quality_, fps_));
+    encoder->SetCodecThreads(codec_threads_);
+    if (!encoder->InitializeEncoder()) {
+        ILOGE("ChunkedEncoder - could not open a chunk encoder");
+        return nullptr;
+    }
+    return encoder.release();
+}
+
+bool ChunkedEncoder::ReceivePackets(Chunk &chunk, FFmpegEncoder &encoder) {
+    while (true) {
+        AVPacket *pkt = av_packet_alloc();
+        if (!pkt) {
+            ILOGE("Could not allocate packet");
+            return false;
+        }
+        int ret = encoder.ReceivePacket(pkt);
+        if (ret < 0) {
+            av_packet_free(&pkt);
+            return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
+        }
+        chunk.packets.push_back(pkt);
+    }
+}
+
+bool ChunkedEncoder::EncodeChunk(const std::vector<std::string> &images, Chunk &chunk,
+                                 FFmpegEncoder &encoder) {
+    // Frame numbers continue from the previous chunk, the timestamps need no rewrite
+    encoder.next_pts = static_cast<int64_t>(chunk.begin) * encoder.pts_increment;
+
+    bool ok = true;
+    for (size_t i = chunk.begin; i < chunk.end && ok; ++i) {
+        AVFrame *imgFrame = encoder.LoadFrame(images[i]);
+        if (!imgFrame) {
+            ILOGE("ChunkedEncoder - failed to load frame: %s", images[i].c_str());
+            return false;
+        }
+        encoder.AssignPts(imgFrame);
+        AVFrame *sw_frame = encoder.ConvertFrame(imgFrame);
+        encoder.frame_pool_.Put(imgFrame);
+        if (!sw_frame) {
+            return false;
+        }
+        ok = encoder.SendFrame(sw_frame) && ReceivePackets(chunk, encoder);
+        encoder.frame_pool_.Put(sw_frame);
+    }
+    // A dropped frame would leave a hole in the timeline, the chunk is failed as a whole
+    return ok && encoder.SendFrame(nullptr) && ReceivePackets(chunk, encoder);
+}
+
+void ChunkedEncoder::EncodeChunks(const std::vector<std::string> &images,
+                                  std::vector<Chunk> &chunks, FFmpegEncoder *encoder) {
+    std::unique_ptr<FFmpegEncoder> owned(encoder);
+    bool drained = false;
+    while (true) {
+        size_t index;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            // Done chunks wait for the ones before them, don't pile up more
+            cv_.wait(lock, [this] { return abort_ || next_chunk_ < next_write_ + window_; });
+            if (abort_ || next_chunk_ >= chunks.size()) {
+                return;
+            }
+            index = next_chunk_++;
+        }
+
+        Chunk &chunk = chunks[index];
+        // The previous chunk drained the codec, every chunk starts with a fresh one
+        if (!owned) {
+            owned.reset(CreateEncoder());
+        } else if (drained && !owned->ReopenCodec()) {
+            ILOGE("ChunkedEncoder - could not reopen a chunk encoder");
+            owned.reset();
+        }
+        drained = true;
+        bool ok = owned && EncodeChunk(images, chunk, *owned);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            chunk.ok = ok;
+            chunk.done = true;
+        }
+        cv_.notify_all();
+    }
+}
+
+bool ChunkedEncoder::OpenOutput(const std::string &output_file,
+                                const AVCodecContext *codec_context) {
+    avformat_alloc_output_context2(&format_context_, nullptr, nullptr, output_file.c_str());
+    if (!format_context_) {
+        ILOGE("Could not allocate format context");
+        return false;
+    }
+
+    video_stream_ = avformat_new_stream(format_context_, nullptr);
+    if (!video_stream_) {
+        ILOGE("Could not create video stream");
+        return false;
+    }
+    video_stream_->time_base = (AVRational) {1, AV_TIME_BASE};
+    avcodec_parameters_from_context(video_stream_->codecpar, codec_context);
+
+    if (!(format_context_->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&format_context_->pb, output_file.c_str(), AVIO_FLAG_WRITE) < 0) {
+            ILOGE("Could not open output file");
+            return false;
+        }
+    }
+    if (avformat_write_header(format_context_, nullptr) < 0) {
+        ILOGE("Error occurred when writing header");
+        return false;
+    }
+    return true;
+}
+
+bool ChunkedEncoder::WriteChunk(Chunk &chunk, AVRational time_base) {
+    bool ok = true;
+    for (AVPacket *&pkt : chunk.packets) {
+        if (ok) {
+            pkt->stream_index = video_stream_->index;
+            av_packet_rescale_ts(pkt, time_base, video_stream_->time_base);
+            if (av_interleaved_write_frame(format_context_, pkt) < 0) {
+                ILOGE("Error writing the encoded packet");
+                ok = false;
+            }
+        }
+        av_packet_free(&pkt);
+    }
+    chunk.packets.clear();
+    return ok;
+}
+
+void ChunkedEncoder::CloseOutput() {
+    if (format_context_ && !(format_context_->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&format_context_->pb);
+    }
+    avformat_free_context(format_context_);
+    format_context_ = nullptr;
+    video_stream_ = nullptr;
+}
+
+bool ChunkedEncoder::Encode(const std::vector<std::string> &images,
+                            const std::string &output_file) {
+    if (images.empty()) {
+        ILOGE("ChunkedEncoder::Encode - nothing to encode");
+        return false;
+    }
+
+    // The first encoder decides the GOP length and the stream parameters, then
+    // encodes the first chunk
+    std::unique_ptr<FFmpegEncoder> first(CreateEncoder());
+    if (!first) {
+        return false;
+    }
+    const AVCodecContext *codec_context = first->codec_context_;
+    // Workers reopen their codecs, keep what the muxer needs
+    AVRational time_base = codec_context->time_base;
+    size_t gop = static_cast<size_t>(std::max(codec_context->gop_size, 1));
+
+    // One GOP per chunk, only the last one may be shorter
+    std::vector<Chunk> chunks;
+    for (size_t begin = 0; begin < images.size(); begin += gop) {
+        chunks.push_back({begin, std::min(begin + gop, images.size()), {}, false, false});
+    }
+    size_t workers = std::min(static_cast<size_t>(instances_), chunks.size());
+    ILOGD("ChunkedEncoder::Encode - %zu frames in %zu chunk(s) of %zu on %zu encoder(s), "
+          "%d codec threads each", images.size(), chunks.size(), gop, workers, codec_threads_);
+
+    if (!OpenOutput(output_file, codec_context)) {
+        CloseOutput();
+        return false;
+    }
+
+    next_chunk_ = 0;
+    next_write_ = 0;
+    window_ = 2 * workers;
+    abort_ = false;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workers; ++i) {
+        threads.emplace_back(&ChunkedEncoder::EncodeChunks, this, std::cref(images),
+                             std::ref(chunks), i == 0 ? first.release() : nullptr);
+    }
+
+    // Mux in chunk order as the chunks complete, the workers keep encoding meanwhile
+    bool ok = true;
+    for (size_t i = 0; i < chunks.size() && ok; ++i) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [&chunks, i] { return chunks[i].done; });
+        }
+        if (!chunks[i].ok) {
+            ILOGE("ChunkedEncoder::Encode - chunk %zu [%zu, %zu) failed", i, chunks[i].begin,
+                  chunks[i].end);
+            ok = false;
+        }
+        ok = ok && WriteChunk(chunks[i], time_base);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            next_write_ = i + 1;
+            abort_ = !ok;
+        }
+        cv_.notify_all();
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    // Free what a failed run leaves behind
+    for (auto &chunk : chunks) {
+        for (AVPacket *&pkt : chunk.packets) {
+            av_packet_free(&pkt);
+        }
+    }
+
+    if (ok && av_write_trailer(format_context_) < 0) {
+        ILOGE("Error occurred when writing trailer");
+        ok = false;
+    }
+    CloseOutput();
+    return ok;
+}
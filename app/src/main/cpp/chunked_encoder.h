@@ -0,0 +1,76 @@
+#ifndef CHUNKED_ENCODER_H
+#define CHUNKED_ENCODER_H
+
+#include "ffmpeg_encoder.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Offline encoding of one long image sequence on several cores.
+//
+// The sequence is cut into one-GOP chunks that a fixed set of worker
+// threads take from a queue, each with an FFmpegEncoder of its own that is
+// reopened between chunks. Encoders are opened with closed GOPs and number
+// their frames from the chunk start, so the packets of consecutive chunks
+// already carry continuous pts/dts. A chunk is muxed as soon as it and all
+// chunks before it are done, into a single file with one header and one
+// trailer, no re-encoding. Workers stay a few chunks ahead of the muxer at
+// most, so only those chunks' packets are held in memory. Every instance
+// gets the same settings and an equal share of the cores as codec threads,
+// so the chunks share one set of stream parameters.
+class ChunkedEncoder {
+ public:
+  // instances == 0 uses one encoder per core
+  ChunkedEncoder(FFmpegEncoder::EncoderType encoder_type, int width, int height, int quality = 4,
+                 int fps = 30, int instances = 0);
+  ~ChunkedEncoder();
+
+  ChunkedEncoder(const ChunkedEncoder&) = delete;
+  ChunkedEncoder& operator=(const ChunkedEncoder&) = delete;
+
+  bool Encode(const std::vector<std::string>& images, const std::string& output_file);
+
+ private:
+  struct Chunk {
+    size_t                 begin;
+    size_t                 end;
+    std::vector<AVPacket*> packets;
+    bool                   done;  // Guarded by mutex_
+    bool                   ok;
+  };
+
+  FFmpegEncoder* CreateEncoder();
+  // Takes chunks from the queue until none are left, encoder is the one to
+  // start with or nullptr
+  void EncodeChunks(const std::vector<std::string>& images, std::vector<Chunk>& chunks,
+                    FFmpegEncoder* encoder);
+  // Encodes images [chunk.begin, chunk.end) into chunk.packets
+  bool EncodeChunk(const std::vector<std::string>& images, Chunk& chunk, FFmpegEncoder& encoder);
+  bool ReceivePackets(Chunk& chunk, FFmpegEncoder& encoder);
+  bool OpenOutput(const std::string& output_file, const AVCodecContext* codec_context);
+  bool WriteChunk(Chunk& chunk, AVRational time_base);
+  void CloseOutput();
+
+  FFmpegEncoder::EncoderType encoder_type_;
+  int                        width_;
+  int                        height_;
+  int                        quality_;
+  int                        fps_;
+  int                        instances_;
+  int                        codec_threads_;  // Per instance
+  AVFormatContext*           format_context_;
+  AVStream*                  video_stream_;
+
+  // Chunk queue, shared by the workers and the muxing thread
+  std::mutex                 mutex_;
+  std::condition_variable    cv_;
+  size_t                     next_chunk_;  // Next one a worker takes
+  size_t                     next_write_;  // Next one to mux
+  size_t                     window_;      // Chunks a worker may run ahead of next_write_
+  bool                       abort_;
+};
+
+#endif /* CHUNKED_ENCODER_H */
@@ -0,0 +1,257 @@
+#include "encode_pipeline.h"
+
+#include "my_log.h"
+#include "trace.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+
+EncodePipeline::EncodePipeline(FFmpegEncoder &encoder, size_t queue_depth, size_t load_workers)
+        : encoder_(encoder), image_queue_(queue_depth), loaded_queue_(queue_depth),
+          converted_queue_(queue_depth), packet_queue_(queue_depth * 2),
+          frames_failed_(0), mux_failed_(false), started_(false) {
+    if (load_workers == 0) {
+        load_workers = std::min(static_cast<size_t>(encoder_.Workers().Concurrency()),
+                                image_queue_.Capacity());
+    }
+    for (size_t i = 0; i < load_workers; ++i) {
+        decoders_.emplace_back(new JpegDecoder());
+    }
+}
+
+EncodePipeline::~EncodePipeline() {
+    Finish();
+}
+
+bool EncodePipeline::Start() {
+    if (started_) {
+        return false;
+    }
+    started_ = true;
+
+    threads_.emplace_back(&EncodePipeline::LoadLoop, this);
+    threads_.emplace_back(&EncodePipeline::ConvertLoop, this);
+    threads_.emplace_back(&EncodePipeline::EncodeLoop, this);
+    threads_.emplace_back(&EncodePipeline::MuxLoop, this);
+    return true;
+}
+
+bool EncodePipeline::Submit(const std::string &img) {
+    if (!started_) {
+        ILOGE("EncodePipeline::Submit - pipeline is not running");
+        return false;
+    }
+    EncoderCounters &stats = encoder_.stats_;
+    stats.FrameSubmitted();
+    // The image queue holds the next queue_depth frames, read them ahead now
+    encoder_.PrefetchFrame(img);
+    stats.Queued(EncoderCounters::kLoadQueue);
+    if (!image_queue_.Push({img, EncoderCounters::NowUs()})) {
+        stats.Dequeued(EncoderCounters::kLoadQueue);
+        stats.FrameDropped();
+        return false;
+    }
+    return true;
+}
+
+bool EncodePipeline::Submit(AVFrame *frame) {
+    if (!started_) {
+        ILOGE("EncodePipeline::Submit - pipeline is not running");
+        encoder_.frame_pool_.Put(frame);
+        return false;
+    }
+    EncoderCounters &stats = encoder_.stats_;
+    stats.FrameSubmitted();
+    frame = encoder_.OwnedFrame(frame);
+    if (!frame) {
+        stats.FrameDropped();
+        return false;
+    }
+    stats.Queued(EncoderCounters::kConvertQueue);
+    if (!loaded_queue_.Push({frame, EncoderCounters::NowUs()})) {
+        stats.Dequeued(EncoderCounters::kConvertQueue);
+        stats.FrameDropped();
+        encoder_.frame_pool_.Put(frame);
+        return false;
+    }
+    return true;
+}
+
+bool EncodePipeline::Finish() {
+    if (!started_) {
+        return false;
+    }
+    started_ = false;
+
+    // Closing the head of the pipeline lets every stage drain and
+    // close the queue behind it in turn
+    image_queue_.Close();
+    for (auto &thread : threads_) {
+        thread.join();
+    }
+    threads_.clear();
+
+    return frames_failed_.load() == 0 && !mux_failed_.load();
+}
+
+void EncodePipeline::LoadLoop() {
+    Tracer::SetThreadName("load");
+    EncoderCounters &stats = encoder_.stats_;
+    std::vector<PendingImage> batch;
+    std::vector<AVFrame *> frames;
+    PendingImage img;
+    // Frames are numbered when converted, this only tags the load spans
+    int64_t next_index = 0;
+    while (image_queue_.Pop(img)) {
+        // Take whatever else is already queued, up to one image per decoder
+        batch.clear();
+        batch.push_back(std::move(img));
+        while (batch.size() < decoders_.size() && image_queue_.TryPop(img)) {
+            batch.push_back(std::move(img));
+        }
+        for (size_t i = 0; i < batch.size(); ++i) {
+            stats.Dequeued(EncoderCounters::kLoadQueue);
+        }
+
+        frames.assign(batch.size(), nullptr);
+        encoder_.Workers().ParallelFor(static_cast<int>(batch.size()), [&](int i) {
+            TRACE_FRAME_SPAN("load", next_index + i);
+            frames[i] = encoder_.LoadFrame(batch[i].path, *decoders_[i]);
+        });
+        next_index += static_cast<int64_t>(batch.size());
+
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (!frames[i]) {
+                ILOGE("Failed to load frame: %s", batch[i].path.c_str());
+                frames_failed_++;
+                stats.FrameDropped();
+                continue;
+            }
+            stats.Queued(EncoderCounters::kConvertQueue);
+            if (!loaded_queue_.Push({frames[i], batch[i].submit_us})) {
+                stats.Dequeued(EncoderCounters::kConvertQueue);
+                stats.FrameDropped();
+                encoder_.frame_pool_.Put(frames[i]);
+            }
+        }
+    }
+    loaded_queue_.Close();
+}
+
+void EncodePipeline::ConvertLoop() {
+    Tracer::SetThreadName("convert");
+    EncoderCounters &stats = encoder_.stats_;
+    PendingFrame pending;
+    while (loaded_queue_.Pop(pending)) {
+        stats.Dequeued(EncoderCounters::kConvertQueue);
+        AVFrame *frame = pending.frame;
+        // Frames reach this stage in encode order, number them here
+        encoder_.AssignPts(frame);
+        encoder_.NumberFrame(frame, pending.submit_us);
+        AVFrame *sw_frame = encoder_.ConvertFrame(frame);
+        encoder_.frame_pool_.Put(frame);
+        if (!sw_frame) {
+            frames_failed_++;
+            stats.FrameDropped();
+            continue;
+        }
+        stats.Queued(EncoderCounters::kEncodeQueue);
+        if (!converted_queue_.Push(sw_frame)) {
+            stats.Dequeued(EncoderCounters::kEncodeQueue);
+            stats.FrameDropped();
+            encoder_.frame_pool_.Put(sw_frame);
+        }
+    }
+    converted_queue_.Close();
+}
+
+void EncodePipeline::EncodeLoop() {
+    Tracer::SetThreadName("encode");
+    EncoderCounters &stats = encoder_.stats_;
+    auto drain = [this, &stats]() {
+        while (true) {
+            AVPacket *pkt = encoder_.packet_pool_.Get();
+            if (!pkt) {
+                ILOGE("Could not allocate packet");
+                return;
+            }
+            if (encoder_.ReceivePacket(pkt) < 0) {
+                encoder_.packet_pool_.Put(pkt);
+                return;
+            }
+            stats.Queued(EncoderCounters::kMuxQueue);
+            if (!packet_queue_.Push(pkt)) {
+                stats.Dequeued(EncoderCounters::kMuxQueue);
+                encoder_.packet_pool_.Put(pkt);
+            }
+        }
+    };
+
+    // With the encoder's drain thread on, packets go from it straight to the
+    // muxer and this stage only sends
+    bool drain_here = !encoder_.DrainsAsync();
+    // The old codec's packets are queued for the muxer before it is replaced
+    auto reopen = [this, &drain, drain_here](int frame_width, int frame_height) {
+        bool flushed = drain_here ? encoder_.SendFrame(nullptr) : encoder_.Flush();
+        if (flushed && drain_here) {
+            drain();
+        }
+        return flushed && encoder_.ReopenCodec(frame_width, frame_height);
+    };
+    // Cleared if the codec could not be reopened, the frames still coming
+    // are dropped then so the stages before keep moving
+    bool codec_open = true;
+    AVFrame *frame = nullptr;
+    while (converted_queue_.Pop(frame)) {
+        stats.Dequeued(EncoderCounters::kEncodeQueue);
+        if (!codec_open) {
+            frames_failed_++;
+            stats.FrameDropped();
+            encoder_.frame_pool_.Put(frame);
+            continue;
+        }
+        if (encoder_.SizeChanged(frame) && !reopen(frame->width, frame->height)) {
+            mux_failed_ = true;
+            codec_open = false;
+            frames_failed_++;
+            stats.FrameDropped();
+            encoder_.frame_pool_.Put(frame);
+            continue;
+        }
+        int64_t encode_start_us = EncoderCounters::NowUs();
+        if (!encoder_.SendFrame(frame)) {
+            frames_failed_++;
+            stats.FrameDropped();
+        }
+        encoder_.frame_pool_.Put(frame);
+        if (drain_here) {
+            drain();
+        }
+        if (encoder_.RetuneDue(EncoderCounters::NowUs() - encode_start_us) && !reopen(0, 0)) {
+            mux_failed_ = true;
+            codec_open = false;
+        }
+    }
+
+    // End of stream, push out whatever the encoder still holds
+    if (codec_open && !drain_here) {
+        if (!encoder_.Flush()) {
+            mux_failed_ = true;
+        }
+    } else if (codec_open && encoder_.SendFrame(nullptr)) {
+        drain();
+    }
+    packet_queue_.Close();
+}
+
+void EncodePipeline::MuxLoop() {
+    Tracer::SetThreadName("mux");
+    AVPacket *pkt = nullptr;
+    while (packet_queue_.Pop(pkt)) {
+        encoder_.stats_.Dequeued(EncoderCounters::kMuxQueue);
+        if (!encoder_.WritePacket(pkt)) {
+            mux_failed_ = true;
+        }
+        encoder_.packet_pool_.Put(pkt);
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef ENCODE_PIPELINE_H
+#define ENCODE_PIPELINE_H
+
+#include "ffmpeg_encoder.h"
+#include "frame_queue.h"
+#include "jpeg_decoder.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs the stages of FFmpegEncoder::EncodeFrame() on separate threads:
+//
+//   Submit() -> load -> convert -> encode -> mux
+//
+// Stages are connected by bounded queues, so a slow stage blocks the ones
+// upstream of it instead of letting frames pile up in memory. Per frame the
+// pipeline costs roughly the slowest stage rather than the sum of them.
+//
+// The load stage takes up to load_workers queued images at a time and loads
+// them in parallel on WorkerPool::Shared(), each slot with its own warm
+// JpegDecoder, then hands the frames on in submission order.
+class EncodePipeline {
+ public:
+  // load_workers == 0 uses one per pool thread, capped at queue_depth
+  explicit EncodePipeline(FFmpegEncoder& encoder, size_t queue_depth = 4, size_t load_workers = 0);
+  ~EncodePipeline();
+
+  bool Start();
+  // Queue an image for encoding, blocks while the load stage is backed up
+  bool Submit(const std::string& img);
+  // Queue a frame already in memory, e.g. from FFmpegEncoder::WrapFrame(). It
+  // skips the load stage, so its order relative to queued paths is not kept.
+  // Takes ownership of the frame, blocks while the convert stage is backed up.
+  // It is converted after this returns, a frame wrapped without a release
+  // callback is copied here so the caller may reuse its planes right away.
+  bool Submit(AVFrame* frame);
+  // Encode everything submitted so far, flush the encoder and stop the threads
+  bool Finish();
+
+  int FramesFailed() const { return frames_failed_.load(); }
+
+ private:
+  // Queued work carries its submit time for the latency stats
+  struct PendingImage {
+    std::string path;
+    int64_t     submit_us;
+  };
+  struct PendingFrame {
+    AVFrame* frame;
+    int64_t  submit_us;
+  };
+
+  void LoadLoop();
+  void ConvertLoop();
+  void EncodeLoop();
+  void MuxLoop();
+
+  FFmpegEncoder&          encoder_;
+  std::vector<std::unique_ptr<JpegDecoder>> decoders_;  // One per load slot
+  BoundedQueue<PendingImage> image_queue_;
+  BoundedQueue<PendingFrame> loaded_queue_;
+  BoundedQueue<AVFrame*>  converted_queue_;
+  BoundedQueue<AVPacket*> packet_queue_;
+  std::vector<std::thread> threads_;
+  std::atomic<int>        frames_failed_;
+  std::atomic<bool>       mux_failed_;
+  bool                    started_;
+};
+
+#endif /* ENCODE_PIPELINE_H */
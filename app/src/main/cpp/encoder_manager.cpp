@@ -0,0 +1,148 @@
+#include "encoder_manager.h"
+
+#include <algorithm>
+#include <thread>
+
+#include "my_log.h"
+
+static int BudgetOrCores(int thread_budget) {
+    if (thread_budget > 0) {
+        return thread_budget;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+static int ConvertThreads(int thread_budget, int convert_threads) {
+    if (convert_threads > 0) {
+        return convert_threads;
+    }
+    return std::max(1, BudgetOrCores(thread_budget) / 4);
+}
+
+// The pool counts the calling thread as one of its own, see WorkerPool
+EncoderManager::EncoderManager(int max_sessions, int thread_budget, int convert_threads)
+        : codec_budget_(std::max(1, BudgetOrCores(thread_budget) -
+                                    ConvertThreads(thread_budget, convert_threads))),
+          max_sessions_(std::max(1, max_sessions)),
+          pool_(static_cast<unsigned>(
+                  std::max(1, ConvertThreads(thread_budget, convert_threads) - 1))) {
+    ILOGD("EncoderManager - %d codec threads for %d session(s), %d conversion threads",
+          codec_budget_, max_sessions_, pool_.Concurrency());
+}
+
+EncoderManager::~EncoderManager() {
+    // Encoders convert on pool_, they go before it does
+    sessions_.clear();
+}
+
+int EncoderManager::OpenSession(FFmpegEncoder::EncoderType encoder_type, int width, int height,
+                                int quality, int fps, const std::string &output_file) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int open = 0;
+    for (const auto &session : sessions_) {
+        open += session ? 1 : 0;
+    }
+    if (open >= max_sessions_) {
+        // Another share would take the codec threads over the budget
+        ILOGE("EncoderManager::OpenSession - %d sessions are already open", open);
+        return -1;
+    }
+
+    std::unique_ptr<Session> session(new Session());
+    session->id = static_cast<int>(sessions_.size());
+    session->codec_threads = std::max(1, codec_budget_ / max_sessions_);
+    session->encoder.reset(new FFmpegEncoder(encoder_type, width, height, quality, fps));
+    session->encoder->SetWorkerPool(&pool_);
+    session->encoder->SetCodecThreads(session->codec_threads);
+    if (!session->encoder->Initialize(output_file)) {
+        ILOGE("EncoderManager::OpenSession - could not initialize %s", output_file.c_str());
+        return -1;
+    }
+    session->opened = std::chrono::steady_clock::now();
+    session->frames = 0;
+    session->frames_failed = 0;
+    session->busy_us = 0;
+
+    ILOGD("EncoderManager::OpenSession - session %d: %s, %d codec threads", session->id,
+          output_file.c_str(), session->codec_threads);
+    sessions_.push_back(std::move(session));
+    return sessions_.back()->id;
+}
+
+EncoderManager::Session *EncoderManager::GetSession(int session) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (session < 0 || session >= static_cast<int>(sessions_.size())) {
+        return nullptr;
+    }
+    return sessions_[session].get();
+}
+
+bool EncoderManager::EncodeFrame(int session, const std::string &img) {
+    Session *s = GetSession(session);
+    if (!s) {
+        ILOGE("EncoderManager::EncodeFrame - no session %d", session);
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok = s->encoder->EncodeFrame(img);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    s->busy_us += std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    if (ok) {
+        s->frames++;
+    } else {
+        s->frames_failed++;
+    }
+    return ok;
+}
+
+bool EncoderManager::CloseSession(int session) {
+    std::unique_ptr<Session> closed;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (session < 0 || session >= static_cast<int>(sessions_.size()) || !sessions_[session]) {
+            ILOGE("EncoderManager::CloseSession - no session %d", session);
+            return false;
+        }
+        closed = std::move(sessions_[session]);
+    }
+    bool ok = closed->encoder->Flush();
+    SessionStats stats = MakeStats(*closed);
+    ILOGD("EncoderManager::CloseSession - session %d: %lld frames, %.1f fps", stats.id,
+          (long long) stats.frames, stats.fps);
+    // Destroying the encoder writes the trailer and closes the file
+    closed.reset();
+    return ok;
+}
+
+EncoderManager::SessionStats EncoderManager::MakeStats(const Session &session) {
+    SessionStats stats = {};
+    stats.id = session.id;
+    stats.codec_threads = session.codec_threads;
+    stats.frames = session.frames.load();
+    stats.frames_failed = session.frames_failed.load();
+    stats.busy_ms = session.busy_us.load() / 1000.0;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                   session.opened).count();
+    stats.fps = seconds > 0 ? stats.frames / seconds : 0;
+    return stats;
+}
+
+std::vector<EncoderManager::SessionStats> EncoderManager::Stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<SessionStats> stats;
+    for (const auto &session : sessions_) {
+        if (session) {
+            stats.push_back(MakeStats(*session));
+        }
+    }
+    return stats;
+}
+
+void EncoderManager::LogStats() const {
+    for (const auto &stats : Stats()) {
+        ILOGI("EncoderManager - session %d: %lld frames (%lld failed), %.1f fps, busy %.0f ms, "
+              "%d codec threads", stats.id, (long long) stats.frames,
+              (long long) stats.frames_failed, stats.fps, stats.busy_ms, stats.codec_threads);
+    }
+}
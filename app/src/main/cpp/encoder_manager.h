@@ -0,0 +1,76 @@
+#ifndef ENCODER_MANAGER_H
+#define ENCODER_MANAGER_H
+
+#include "ffmpeg_encoder.h"
+#include "worker_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Runs many encoder sessions (e.g. one per camera) inside one CPU budget.
+//
+// Without it every FFmpegEncoder converts on the process-wide pool and lets
+// the codec start one thread per core, so N sessions run N times too many
+// threads. The manager owns one conversion pool for all of its sessions and
+// splits the rest of the budget into max_sessions equal shares of codec
+// threads. A codec keeps its threads while it is open, so the shares are
+// fixed and at most max_sessions sessions are open at once.
+//
+// Sessions may be driven from different threads, one thread per session.
+// A session is closed from the thread that drives it.
+class EncoderManager {
+ public:
+  struct SessionStats {
+    int     id;
+    int     codec_threads;
+    int64_t frames;         // Frames encoded
+    int64_t frames_failed;
+    double  busy_ms;        // Time spent inside EncodeFrame()
+    double  fps;            // Frames per second since the session opened
+  };
+
+  // thread_budget == 0 uses one thread per core, convert_threads == 0 gives
+  // a quarter of the budget to conversion
+  explicit EncoderManager(int max_sessions, int thread_budget = 0, int convert_threads = 0);
+  ~EncoderManager();
+
+  EncoderManager(const EncoderManager&) = delete;
+  EncoderManager& operator=(const EncoderManager&) = delete;
+
+  // Returns the session id, or -1 if max_sessions are open or the encoder
+  // could not be initialized
+  int  OpenSession(FFmpegEncoder::EncoderType encoder_type, int width, int height,
+                   int quality, int fps, const std::string& output_file);
+  bool EncodeFrame(int session, const std::string& img);
+  // Flushes and closes the output file of the session
+  bool CloseSession(int session);
+
+  std::vector<SessionStats> Stats() const;
+  void LogStats() const;
+
+ private:
+  struct Session {
+    int                                   id;
+    int                                   codec_threads;
+    std::unique_ptr<FFmpegEncoder>        encoder;
+    std::chrono::steady_clock::time_point opened;
+    std::atomic<int64_t>                  frames;
+    std::atomic<int64_t>                  frames_failed;
+    std::atomic<int64_t>                  busy_us;
+  };
+
+  Session* GetSession(int session) const;
+  static SessionStats MakeStats(const Session& session);
+
+  int                                   codec_budget_;
+  int                                   max_sessions_;
+  WorkerPool                            pool_;
+  mutable std::mutex                    mutex_;
+  std::vector<std::unique_ptr<Session>> sessions_;  // Indexed by id, null once closed
+};
+
+#endif /* ENCODER_MANAGER_H */
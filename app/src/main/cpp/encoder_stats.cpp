@@ -0,0 +1,134 @@
+#include "encoder_stats.h"
+
+#include <chrono>
+
+double EncoderStats::MeanLatencyMs() const {
+    return latency_samples > 0 ? latency_sum_us / 1000.0 / latency_samples : 0;
+}
+
+double EncoderStats::LatencyPercentileMs(double p) const {
+    if (latency_samples <= 0) {
+        return 0;
+    }
+    int64_t rank = static_cast<int64_t>(p / 100.0 * latency_samples + 0.5);
+    int64_t seen = 0;
+    for (int i = 0; i < kLatencyBuckets - 1; ++i) {
+        seen += latency_buckets[i];
+        if (seen >= rank) {
+            return static_cast<double>(1 << i);
+        }
+    }
+    return latency_max_us / 1000.0;
+}
+
+EncoderCounters::EncoderCounters()
+        : frames_submitted_(0), frames_encoded_(0), frames_dropped_(0), packets_muxed_(0),
+          bytes_muxed_(0), keyframes_(0), latency_samples_(0), latency_sum_us_(0),
+          latency_max_us_(0), latency_last_us_(-1), latency_first_us_(-1), latency_budget_us_(0),
+          late_frames_(0), next_sequence_(0) {
+    for (auto &queue : queues_) {
+        queue = 0;
+    }
+    for (auto &bucket : latency_buckets_) {
+        bucket = 0;
+    }
+    for (auto &pending : pending_) {
+        pending.sequence = -1;
+        pending.pts = 0;
+        pending.submit_us = 0;
+    }
+}
+
+int64_t EncoderCounters::NowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t EncoderCounters::FrameNumbered(int64_t pts, int64_t submit_us) {
+    int64_t sequence = next_sequence_.fetch_add(1, std::memory_order_relaxed) % kMaxSequence;
+    Pending &pending = pending_[sequence % kPendingSlots];
+    pending.pts.store(pts, std::memory_order_relaxed);
+    pending.submit_us.store(submit_us, std::memory_order_relaxed);
+    // Published last, PacketEncoded() only trusts the time once the sequence matches
+    pending.sequence.store(sequence, std::memory_order_release);
+    return sequence;
+}
+
+const EncoderCounters::Pending *EncoderCounters::FindPending(int64_t sequence, int64_t pts) const {
+    if (sequence >= 0) {
+        const Pending &pending = pending_[sequence % kPendingSlots];
+        // Otherwise overwritten by a frame kPendingSlots later
+        return pending.sequence.load(std::memory_order_acquire) == sequence ? &pending : nullptr;
+    }
+    for (const Pending &pending : pending_) {
+        if (pending.sequence.load(std::memory_order_acquire) >= 0 &&
+            pending.pts.load(std::memory_order_relaxed) == pts) {
+            return &pending;
+        }
+    }
+    return nullptr;
+}
+
+void EncoderCounters::PacketEncoded(int64_t sequence, int64_t pts, bool keyframe) {
+    Add(frames_encoded_);
+    if (keyframe) {
+        Add(keyframes_);
+    }
+
+    const Pending *pending = FindPending(sequence, pts);
+    if (!pending) {
+        return;
+    }
+    int64_t latency_us = NowUs() - pending->submit_us.load(std::memory_order_relaxed);
+    if (latency_us < 0) {
+        latency_us = 0;
+    }
+
+    int bucket = 0;
+    while (bucket < EncoderStats::kLatencyBuckets - 1 && latency_us >= (1000LL << bucket)) {
+        ++bucket;
+    }
+    Add(latency_buckets_[bucket]);
+    Add(latency_samples_);
+    Add(latency_sum_us_, latency_us);
+    latency_last_us_.store(latency_us, std::memory_order_relaxed);
+    int64_t unset = -1;
+    latency_first_us_.compare_exchange_strong(unset, latency_us, std::memory_order_relaxed);
+    int64_t budget_us = latency_budget_us_.load(std::memory_order_relaxed);
+    if (budget_us > 0 && latency_us > budget_us) {
+        Add(late_frames_);
+    }
+    int64_t max_us = latency_max_us_.load(std::memory_order_relaxed);
+    while (latency_us > max_us &&
+           !latency_max_us_.compare_exchange_weak(max_us, latency_us, std::memory_order_relaxed)) {
+    }
+}
+
+void EncoderCounters::PacketMuxed(int size) {
+    Add(packets_muxed_);
+    Add(bytes_muxed_, size);
+}
+
+EncoderStats EncoderCounters::Snapshot() const {
+    EncoderStats stats;
+    stats.frames_submitted = frames_submitted_.load(std::memory_order_relaxed);
+    stats.frames_encoded = frames_encoded_.load(std::memory_order_relaxed);
+    stats.frames_dropped = frames_dropped_.load(std::memory_order_relaxed);
+    stats.packets_muxed = packets_muxed_.load(std::memory_order_relaxed);
+    stats.bytes_muxed = bytes_muxed_.load(std::memory_order_relaxed);
+    stats.keyframes = keyframes_.load(std::memory_order_relaxed);
+    stats.load_queue = queues_[kLoadQueue].load(std::memory_order_relaxed);
+    stats.convert_queue = queues_[kConvertQueue].load(std::memory_order_relaxed);
+    stats.encode_queue = queues_[kEncodeQueue].load(std::memory_order_relaxed);
+    stats.mux_queue = queues_[kMuxQueue].load(std::memory_order_relaxed);
+    for (int i = 0; i < EncoderStats::kLatencyBuckets; ++i) {
+        stats.latency_buckets[i] = latency_buckets_[i].load(std::memory_order_relaxed);
+    }
+    stats.latency_samples = latency_samples_.load(std::memory_order_relaxed);
+    stats.latency_sum_us = latency_sum_us_.load(std::memory_order_relaxed);
+    stats.latency_max_us = latency_max_us_.load(std::memory_order_relaxed);
+    stats.latency_last_us = latency_last_us_.load(std::memory_order_relaxed);
+    stats.latency_first_us = latency_first_us_.load(std::memory_order_relaxed);
+    stats.late_frames = late_frames_.load(std::memory_order_relaxed);
+    return stats;
+}
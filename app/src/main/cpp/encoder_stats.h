@@ -0,0 +1,114 @@
+#ifndef ENCODER_STATS_H
+#define ENCODER_STATS_H
+
+#include <atomic>
+#include <cstdint>
+
+// Sequence numbers wrap here, they travel in AVFrame/AVPacket::opaque
+constexpr int64_t kMaxSequence = INTPTR_MAX;
+
+// Snapshot returned by FFmpegEncoder::GetStats()
+struct EncoderStats {
+  // Latency bucket i counts frames that took less than 1 << i ms from
+  // submission to their packet coming out of the codec, the last bucket
+  // everything slower
+  static constexpr int kLatencyBuckets = 16;
+
+  int64_t frames_submitted;
+  int64_t frames_encoded;     // Packets out of the codec, one per frame
+  int64_t frames_dropped;     // Failed to load, convert or send
+  int64_t packets_muxed;
+  int64_t bytes_muxed;
+  int64_t keyframes;
+
+  // Frames waiting in front of each EncodePipeline stage, 0 without one
+  int     load_queue;
+  int     convert_queue;
+  int     encode_queue;
+  int     mux_queue;
+
+  int64_t latency_buckets[kLatencyBuckets];
+  int64_t latency_samples;
+  int64_t latency_sum_us;
+  int64_t latency_max_us;
+  int64_t latency_last_us;    // Of the latest packet, -1 before the first
+  int64_t latency_first_us;   // Of the first packet, what a viewer waits for
+  int64_t late_frames;        // Over the latency budget, see SetLatencyBudget()
+
+  double  MeanLatencyMs() const;
+  // Upper bound of the bucket holding the p-th percentile, in ms
+  double  LatencyPercentileMs(double p) const;
+};
+
+// Counters behind EncoderStats. Every update is a relaxed atomic, so the
+// encode threads never block and a poller can read at any time. A snapshot
+// is not taken atomically as a whole, counters may be a frame apart.
+class EncoderCounters {
+ public:
+  enum Queue { kLoadQueue, kConvertQueue, kEncodeQueue, kMuxQueue, kQueueCount };
+
+  EncoderCounters();
+
+  EncoderCounters(const EncoderCounters&) = delete;
+  EncoderCounters& operator=(const EncoderCounters&) = delete;
+
+  static int64_t NowUs();
+
+  void FrameSubmitted() { Add(frames_submitted_); }
+  void FrameDropped() { Add(frames_dropped_); }
+  // A frame with the given pts entered the encoder at submit_us, see NowUs().
+  // Returns its sequence number, which keys the latency sample whatever the
+  // pts spacing; it stays below kMaxSequence so it fits a pointer.
+  int64_t FrameNumbered(int64_t pts, int64_t submit_us);
+  // The codec returned a packet. sequence is that of its frame, or -1 when the
+  // codec could not carry it, the frame is then looked up by its exact pts.
+  void PacketEncoded(int64_t sequence, int64_t pts, bool keyframe);
+  void PacketMuxed(int size);
+  // Frames slower than this from submission to packet count as late, 0 (default) none
+  void SetLatencyBudget(int64_t budget_us) {
+      latency_budget_us_.store(budget_us, std::memory_order_relaxed);
+  }
+
+  void Queued(Queue queue) { queues_[queue].fetch_add(1, std::memory_order_relaxed); }
+  void Dequeued(Queue queue) { queues_[queue].fetch_sub(1, std::memory_order_relaxed); }
+
+  EncoderStats Snapshot() const;
+
+ private:
+  // Submit times are kept for the frames inside the codec, more than the
+  // deepest lookahead of the encoders in use
+  static constexpr int kPendingSlots = 256;
+
+  struct Pending {
+    std::atomic<int64_t> sequence;
+    std::atomic<int64_t> pts;
+    std::atomic<int64_t> submit_us;
+  };
+
+  // The pending slot of a sequence number, or of a pts if sequence is -1
+  const Pending* FindPending(int64_t sequence, int64_t pts) const;
+
+  static void Add(std::atomic<int64_t>& counter, int64_t value = 1) {
+    counter.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  std::atomic<int64_t> frames_submitted_;
+  std::atomic<int64_t> frames_encoded_;
+  std::atomic<int64_t> frames_dropped_;
+  std::atomic<int64_t> packets_muxed_;
+  std::atomic<int64_t> bytes_muxed_;
+  std::atomic<int64_t> keyframes_;
+  std::atomic<int>     queues_[kQueueCount];
+  std::atomic<int64_t> latency_buckets_[EncoderStats::kLatencyBuckets];
+  std::atomic<int64_t> latency_samples_;
+  std::atomic<int64_t> latency_sum_us_;
+  std::atomic<int64_t> latency_max_us_;
+  std::atomic<int64_t> latency_last_us_;
+  std::atomic<int64_t> latency_first_us_;
+  std::atomic<int64_t> latency_budget_us_;
+  std::atomic<int64_t> late_frames_;
+  std::atomic<int64_t> next_sequence_;
+  Pending              pending_[kPendingSlots];
+};
+
+#endif /* ENCODER_STATS_H */
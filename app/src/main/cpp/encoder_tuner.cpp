@@ -0,0 +1,105 @@
+#include "encoder_tuner.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include <algorithm>
+
+// Fastest first. Slower ones than medium cost a lot for little on phones.
+static const char *const kPresets[] = {"ultrafast", "superfast", "veryfast", "faster", "fast",
+                                       "medium"};
+constexpr int kPresetCount = sizeof(kPresets) / sizeof(kPresets[0]);
+constexpr int kStartPreset = 2;
+// Below this share of the budget a slower preset is tried. One preset step
+// costs roughly 1.3-1.6x, the margin keeps the next one within budget.
+constexpr double kHeadroom = 0.65;
+
+EncoderTuner::EncoderTuner(double target_fps, int cores, bool frame_threads, int max_threads)
+        : budget_us_(static_cast<int64_t>(1000000 / target_fps)),
+          window_(std::max(15, static_cast<int>(target_fps + 0.5))), frames_(0), sum_us_(0),
+          warming_up_(true), preset_(kStartPreset), threads_(0), thread_steps_(0),
+          preset_cap_(kPresetCount - 1), threads_floor_(0), last_step_(Step::kNone) {
+    if (max_threads > 0) {
+        cores = std::min(cores, max_threads);
+    }
+    cores = std::max(1, cores);
+    auto add = [this](int threads, int type) {
+        thread_counts_[thread_steps_] = threads;
+        thread_types_[thread_steps_] = type;
+        ++thread_steps_;
+    };
+    // Slices add no delay but split the picture, frame threads scale further
+    add(1, FF_THREAD_SLICE);
+    for (int threads = 2; threads < cores; threads *= 2) {
+        add(threads, FF_THREAD_SLICE);
+    }
+    if (cores > 1) {
+        add(cores, FF_THREAD_SLICE);
+    }
+    if (cores > 1 && frame_threads) {
+        add(cores, FF_THREAD_FRAME);
+    }
+    bool oversubscribe = cores > 1 && frame_threads && max_threads <= 0;
+    if (oversubscribe) {
+        // What libx264 picks by itself
+        add(cores * 3 / 2, FF_THREAD_FRAME);
+    }
+    // Start from every core, on frame threads if allowed
+    threads_ = oversubscribe ? thread_steps_ - 2 : thread_steps_ - 1;
+    Apply();
+}
+
+bool EncoderTuner::AddFrame(int64_t encode_us) {
+    sum_us_ += encode_us;
+    if (++frames_ < window_) {
+        return false;
+    }
+    int64_t mean_us = sum_us_ / frames_;
+    frames_ = 0;
+    sum_us_ = 0;
+    if (warming_up_) {
+        // A fresh codec fills its lookahead and threads first
+        warming_up_ = false;
+        return false;
+    }
+
+    Step last_step = last_step_;
+    last_step_ = Step::kNone;
+    if (mean_us > budget_us_) {
+        if (last_step == Step::kSlowerPreset) {
+            // Undo what was just tried for quality, and do not try it again
+            preset_cap_ = --preset_;
+        } else if (last_step == Step::kFewerThreads) {
+            threads_floor_ = ++threads_;
+        } else if (threads_ + 1 < thread_steps_) {
+            ++threads_;
+        } else if (preset_ > 0) {
+            --preset_;
+        } else {
+            // Nothing faster left
+            return false;
+        }
+    } else if (mean_us < budget_us_ * kHeadroom) {
+        if (preset_ < preset_cap_) {
+            ++preset_;
+            last_step_ = Step::kSlowerPreset;
+        } else if (threads_ > threads_floor_) {
+            --threads_;
+            last_step_ = Step::kFewerThreads;
+        } else {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    Apply();
+    warming_up_ = true;
+    return true;
+}
+
+void EncoderTuner::Apply() {
+    current_.preset = kPresets[preset_];
+    current_.threads = thread_counts_[threads_];
+    current_.thread_type = thread_types_[threads_];
+}
@@ -0,0 +1,55 @@
+#ifndef ENCODER_TUNER_H
+#define ENCODER_TUNER_H
+
+#include <cstdint>
+
+// libx264 settings the tuner picks between
+struct CodecSettings {
+  const char* preset;
+  int         threads;
+  int         thread_type;  // FF_THREAD_FRAME or FF_THREAD_SLICE
+};
+
+// Picks the slowest libx264 preset and the fewest threads that still encode
+// at a target frame rate on this device.
+//
+// Fed the encode time of every frame, it judges the mean over a window of
+// about a second. Over budget it first adds threads (slices, then frame
+// threads, which scale further), then goes to a faster preset. Well under
+// budget it goes to a slower preset, at the slowest one it gives threads
+// back. A step that turns out too slow right away is undone and not tried
+// again, so the settings settle instead of flapping. Without frame_threads
+// (live mode, they delay every frame) the ladder stops at slice threads.
+// max_threads caps every step, e.g. a session's share of a CPU budget;
+// without it the ladder ends at the 1.5x cores frame threads libx264 picks.
+class EncoderTuner {
+ public:
+  EncoderTuner(double target_fps, int cores, bool frame_threads, int max_threads = 0);
+
+  const CodecSettings& Current() const { return current_; }
+  // Encode time of one frame. True when the settings changed, the codec
+  // has to be reopened with Current() then.
+  bool AddFrame(int64_t encode_us);
+
+ private:
+  enum class Step { kNone, kSlowerPreset, kFewerThreads };
+
+  void Apply();
+
+  int64_t       budget_us_;
+  int           window_;
+  int           frames_;
+  int64_t       sum_us_;
+  bool          warming_up_;  // First window after a reopen is not judged
+  int           preset_;      // Index into the preset ladder
+  int           threads_;     // Index into the thread ladder
+  int           thread_steps_;
+  int           preset_cap_;     // Slowest preset still to try
+  int           threads_floor_;  // Fewest threads still to try
+  Step          last_step_;
+  int           thread_counts_[12];
+  int           thread_types_[12];
+  CodecSettings current_;
+};
+
+#endif /* ENCODER_TUNER_H */
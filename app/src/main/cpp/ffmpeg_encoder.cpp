@@ -1,14 +1,19 @@
 #include "ffmpeg_encoder.h"
 
+extern "C" {
+#include <libavutil/intreadwrite.h>
+}
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <string>
-#include <fstream>
 
-#ifndef ANDROID
+#if defined(SUPPORT_HW_ENCODER) && !defined(ANDROID)
 #include "nvenc_utils.h"
 #endif
 
-#define USE_MRS_CODE 1
-
 #if USE_RAW
 #define FPS 10
 #else
@@ -16,11 +21,24 @@
 #endif
 
 #include "my_log.h"
+#include "raw_frame_loader.h"
+#include "trace.h"
+#include "worker_pool.h"
 
 constexpr int kBitrateQualityScale = 200000;
+// Frame structs kept around, enough for the pipeline queues plus a load batch
+constexpr int kPooledFrames = 24;
+constexpr int kPooledPackets = 16;
+// Pooled packet payloads hold a quarter byte per pixel, bigger packets (large
+// keyframes) get a plain allocation
+constexpr int kPacketBufferDivisor = 4;
+constexpr int kMinPacketBufferSize = 64 * 1024;
 const char *kEncoderTypeNames[] = {"VAAPI", "NVENC", "MEDIACODEC", "LIBX264"};
 
 static void dump_avframe_info(AVFrame* in_frame) {
+    if (!LOG_ENABLED(DEBUG)) {
+        return;
+    }
     if (!in_frame) {
         ILOGD("Invalid AVFrame pointer");
         return;
@@ -41,18 +59,108 @@ static void dump_avframe_info(AVFrame* in_frame) {
     }
 }
 
+// Whether an Annex-B access unit has an SPS before its first slice
+static bool H264HasParameterSets(const uint8_t *data, int size) {
+    for (int i = 0; i + 3 < size; ++i) {
+        if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1) {
+            continue;
+        }
+        int nal_type = data[i + 3] & 0x1f;
+        if (nal_type == 7) {
+            return true;
+        }
+        if (nal_type >= 1 && nal_type <= 5) {
+            return false;
+        }
+        i += 2;
+    }
+    return false;
+}
+
+// SPS/PPS of the codec's extradata as Annex-B. Encoders hand out either
+// Annex-B already or an avcC record (libx264 with annexb=0, some HW ones).
+static bool H264ParameterSets(const uint8_t *extradata, int size, std::vector<uint8_t> &out) {
+    static const uint8_t kStartCode[] = {0, 0, 0, 1};
+    out.clear();
+    if (!extradata || size < 4) {
+        return false;
+    }
+    if (extradata[0] != 1) {
+        out.assign(extradata, extradata + size);
+        return true;
+    }
+
+    // avcC: 5 header bytes, then a count byte and 16-bit length prefixed
+    // units for the SPS, again for the PPS
+    int pos = 5;
+    for (int list = 0; list < 2; ++list) {
+        if (pos >= size) {
+            break;
+        }
+        int count = list == 0 ? extradata[pos] & 0x1f : extradata[pos];
+        ++pos;
+        for (int i = 0; i < count && pos + 2 <= size; ++i) {
+            int length = (extradata[pos] << 8) | extradata[pos + 1];
+            pos += 2;
+            if (pos + length > size) {
+                out.clear();
+                return false;
+            }
+            out.insert(out.end(), kStartCode, kStartCode + sizeof(kStartCode));
+            out.insert(out.end(), extradata + pos, extradata + pos + length);
+            pos += length;
+        }
+    }
+    return !out.empty();
+}
+
+// A frame size in one atomic word, so a reader never sees half a change
+static int64_t PackSize(int width, int height) {
+    return (static_cast<int64_t>(width) << 32) | static_cast<uint32_t>(height);
+}
+
+static int SizeWidth(int64_t size) {
+    return static_cast<int>(size >> 32);
+}
+
+static int SizeHeight(int64_t size) {
+    return static_cast<int>(size & 0xffffffff);
+}
+
 FFmpegEncoder::FFmpegEncoder(EncoderType pEncoderType, int pWidth, int pHeight, int pQuality,
                              int pFps)
         : format_context_(nullptr), codec_context_(nullptr), video_stream_(nullptr),
 #ifdef SUPPORT_HW_ENCODER
         hw_device_ctx(nullptr),
 #endif
-          next_pts(0), pts_increment((AV_TIME_BASE + FPS / 2) / FPS), encoder_type_(pEncoderType),
-          width(pWidth), height(pHeight), fps(pFps), quality(pQuality) {
+          worker_pool_(nullptr), next_pts(0), pts_increment((AV_TIME_BASE + FPS / 2) / FPS), encoder_type_(pEncoderType),
+          bit_rate_(2000000), bitrate_changed_(false), keyframe_requested_(false),
+          requested_increment_(0), runtime_bitrate_(false), codec_opened_(false),
+          rate_change_count_(1), quality(pQuality), fps(pFps), width(pWidth), height(pHeight),
+          output_size_(PackSize(pWidth, pHeight)), raw_input_size_(PackSize(pWidth, pHeight)),
+          convert_format_(AV_PIX_FMT_NONE), codec_reopened_(false),
+          header_written_(false), flushed_(false), closed_gop_(false), codec_threads_(0),
+          packet_(nullptr), packet_buffers_(nullptr), packet_buffer_size_(0),
+          pool_packets_(false), use_drain_thread_(false), buffered_output_(true),
+          expected_duration_s_(0), fragment_ms_(0), annexb_output_(false),
+          annexb_file_(nullptr), live_mode_(false), target_fps_(0),
+          last_dts_(AV_NOPTS_VALUE), segment_s_(0), segment_bytes_(0),
+          segment_index_(0), segment_start_pts_(AV_NOPTS_VALUE), segment_end_pts_(AV_NOPTS_VALUE),
+          segment_size_(0), segment_offset_(0), segment_due_(false), segment_failed_(false),
+          stream_params_(nullptr),
+          drain_requested_(false),
+          drain_stop_(false), drain_eof_(false), drain_failed_(false) {
     // Constructor initialization
     // av_register_all();
     // avcodec_register_all();
-    av_log_set_level(AV_LOG_TRACE);
+    // FFmpeg's own lines are formatted even when nobody reads them, keep
+    // the chatty levels to debug builds
+    av_log_set_level(LOG_ENABLED(DEBUG) ? AV_LOG_VERBOSE : AV_LOG_WARNING);
+
+    converter_.SetFramePool(&frame_pool_);
+    rate_changes_[0].pts = 0;
+    rate_changes_[0].index = 0;
+    rate_changes_[0].increment = pts_increment;
 
 #ifdef SUPPORT_HW_ENCODER
     InitializeHWContext();
@@ -64,7 +172,39 @@ FFmpegEncoder::~FFmpegEncoder() {
 }
 
 bool FFmpegEncoder::Initialize(const std::string &output_file) {
-    return OpenVideoFile(output_file) && SetupEncoder(output_file);
+    // Packets go straight to the muxer, only a few payloads are alive at once.
+    // InitializeEncoder() callers hold a chunk's worth, those stay unpooled.
+    pool_packets_ = true;
+    if (target_fps_ > 0 && encoder_type_ != EncoderType::LIBX264) {
+        ILOGW("Only libx264 can be tuned to a frame rate, keeping the fixed settings");
+    } else if (target_fps_ > 0) {
+        unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        // SetCodecThreads() is this session's share, e.g. from EncoderManager
+        tuner_.reset(new EncoderTuner(target_fps_, static_cast<int>(cores), !live_mode_,
+                                      codec_threads_));
+    }
+    std::string path = output_file;
+    if (Segmented()) {
+        output_pattern_ = output_file;
+        path = SegmentPath(segment_index_);
+    }
+    if (annexb_output_) {
+        if (!SetupEncoder() || !SetupAnnexBOutput(path)) {
+            return false;
+        }
+    } else if (!OpenVideoFile(path) || !SetupEncoder() || !SetupOutput(path)) {
+        return false;
+    }
+    if (use_drain_thread_) {
+        drain_thread_ = std::thread(&FFmpegEncoder::DrainLoop, this);
+    }
+    return true;
+}
+
+bool FFmpegEncoder::InitializeEncoder() {
+    // Chunks are spliced back to back, no GOP may reference a frame before it
+    closed_gop_ = true;
+    return SetupEncoder();
 }
 
 #ifdef SUPPORT_HW_ENCODER
@@ -98,14 +238,30 @@ bool FFmpegEncoder::InitializeHWContext() {
 #endif
 
 void FFmpegEncoder::Cleanup() {
-    WriteTrailer();
+    if (header_written_) {
+        Flush();
+        WriteTrailer();
+        header_written_ = false;
+    }
+    StopDrainThread();
 
     // Release all allocated resources
+    if (annexb_file_)
+        CloseOutputFile(&annexb_file_);
     if (format_context_ && !(format_context_->oformat->flags & AVFMT_NOFILE))
-        avio_closep(&format_context_->pb);
+        CloseOutputFile(&format_context_->pb);
+    if (Segmented() && !segment_failed_ && segment_start_pts_ != AV_NOPTS_VALUE) {
+        FinishSegment(segment_end_pts_, true);
+    }
 
+    converter_.Reset();
+    av_packet_free(&packet_);
     avcodec_free_context(&codec_context_);
+    // Payloads still referenced are freed when they come back
+    av_buffer_pool_uninit(&packet_buffers_);
     avformat_free_context(format_context_);
+    format_context_ = nullptr;
+    avcodec_parameters_free(&stream_params_);
 #ifdef SUPPORT_HW_ENCODER
     av_buffer_unref(&hw_device_ctx);
 #endif
@@ -122,7 +278,7 @@ bool FFmpegEncoder::OpenVideoFile(const std::string &output_file) {
     return true;
 }
 
-bool FFmpegEncoder::SetupEncoder(const std::string &output_file) {
+bool FFmpegEncoder::SetupEncoder() {
     // Find the encoder
     const AVCodec *codec = nullptr;
 
@@ -205,15 +361,45 @@ bool FFmpegEncoder::SetupEncoder(const std::string &output_file) {
 
     // These options are optional
     codec_context_->time_base = AV_TIME_BASE_Q;
-    codec_context_->bit_rate = 2000000;
+    codec_context_->bit_rate = bit_rate_.load();
+    if (runtime_bitrate_) {
+        // libx264 only changes the bitrate of a running encode under VBV
+        codec_context_->rc_max_rate = codec_context_->bit_rate;
+        codec_context_->rc_buffer_size = static_cast<int>(codec_context_->bit_rate);
+    }
     codec_context_->level = 32;
     codec_context_->codec_id = AV_CODEC_ID_H264;
     codec_context_->codec_type = AVMEDIA_TYPE_VIDEO;
     codec_context_->gop_size = 12;
+    if (fragment_ms_ > 0) {
+        // One GOP per fragment, every fragment can be played on its own. The
+        // frames are as far apart as their timestamps, not the nominal fps.
+        int64_t frame_us = FrameDuration(next_pts.load());
+        codec_context_->gop_size = static_cast<int>(
+                std::max<int64_t>(1, (fragment_ms_ * int64_t(1000) + frame_us / 2) / frame_us));
+    }
 #ifndef ANDROID
     codec_context_->max_b_frames = 1;
 #endif
+    if (live_mode_) {
+        // A frame's packet comes out as soon as it is encoded, frame threads
+        // would hold one back per thread
+        codec_context_->max_b_frames = 0;
+        codec_context_->flags |= AV_CODEC_FLAG_LOW_DELAY;
+        codec_context_->thread_type = FF_THREAD_SLICE;
+    }
     codec_context_->pix_fmt = pix_fmt;
+    if (closed_gop_) {
+        codec_context_->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+    }
+    if (annexb_output_) {
+        // SPS/PPS in extradata, WriteAnnexBPacket() repeats them itself.
+        // A reopened codec's reach it as packet side data.
+        codec_context_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+    if (codec_threads_ > 0) {
+        codec_context_->thread_count = codec_threads_;
+    }
 
 #ifdef SUPPORT_HW_ENCODER
     codec_context_->hw_device_ctx = av_buffer_ref(hw_device_ctx);
@@ -281,12 +467,85 @@ bool FFmpegEncoder::SetupEncoder(const std::string &output_file) {
             av_dict_set(&opts, "reorder_queue_size", nullptr, AV_DICT_MATCH_CASE);
         }
     }
+    if (tuner_) {
+        const CodecSettings &settings = tuner_->Current();
+        av_dict_set(&opts, "preset", settings.preset, 0);
+        codec_context_->thread_count = settings.threads;
+        codec_context_->thread_type = settings.thread_type;
+    }
+    if (encoder_type_ == EncoderType::LIBX264) {
+        // RequestKeyframe() asks for an IDR, not just an I-frame
+        av_dict_set(&opts, "forced-idr", "1", 0);
+    }
+    if (live_mode_ && encoder_type_ == EncoderType::LIBX264) {
+        av_dict_set(&opts, "tune", "zerolatency", 0);
+        av_dict_set(&opts, "rc-lookahead", "0", 0);
+        // A column of intra blocks sweeps the picture once per GOP instead
+        av_dict_set(&opts, "intra-refresh", "1", 0);
+    }
+
+    // Packets carry their frame's sequence number back for the latency stats
+    if (codec->capabilities & AV_CODEC_CAP_ENCODER_REORDERED_OPAQUE) {
+        codec_context_->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
+    }
+
+    if (pool_packets_ && (codec->capabilities & AV_CODEC_CAP_DR1)) {
+        packet_buffer_size_ = std::max(width * height / kPacketBufferDivisor, kMinPacketBufferSize);
+        packet_buffers_ = av_buffer_pool_init(packet_buffer_size_, nullptr);
+        if (packet_buffers_) {
+            codec_context_->opaque = this;
+            codec_context_->get_encode_buffer = GetEncodeBuffer;
+        }
+    }
 
-    if (avcodec_open2(codec_context_, codec, &opts) < 0) {
+    ret = avcodec_open2(codec_context_, codec, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
         ILOGE("Could not open codec");
         return false;
     }
 
+    // Hardware encoders are fed NV12 and upload it themselves
+    AVPixelFormat convert_format = codec_context_->pix_fmt;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(convert_format);
+    if (!desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+        convert_format = AV_PIX_FMT_NV12;
+    }
+    if (!sws_isSupportedOutput(convert_format)) {
+        ILOGE("swscale does not support the encoder's format: %s",
+              av_get_pix_fmt_name(convert_format));
+    }
+    convert_format_ = convert_format;
+    codec_opened_ = true;
+
+    // Allocate the per-frame structs now rather than on the first frames
+    frame_pool_.Reserve(kPooledFrames);
+    packet_pool_.Reserve(kPooledPackets);
+    if (!packet_) {
+        packet_ = av_packet_alloc();
+    }
+    if (!packet_) {
+        ILOGE("Could not allocate packet");
+        return false;
+    }
+    return true;
+}
+
+int FFmpegEncoder::GetEncodeBuffer(AVCodecContext *context, AVPacket *pkt, int flags) {
+    FFmpegEncoder *encoder = static_cast<FFmpegEncoder *>(context->opaque);
+    if (pkt->size > encoder->packet_buffer_size_ - AV_INPUT_BUFFER_PADDING_SIZE) {
+        return avcodec_default_get_encode_buffer(context, pkt, flags);
+    }
+    pkt->buf = av_buffer_pool_get(encoder->packet_buffers_);
+    if (!pkt->buf) {
+        return AVERROR(ENOMEM);
+    }
+    pkt->data = pkt->buf->data;
+    memset(pkt->data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    return 0;
+}
+
+bool FFmpegEncoder::SetupOutput(const std::string &output_file) {
     // Create new video stream
     video_stream_ = avformat_new_stream(format_context_, nullptr);
     if (!video_stream_) {
@@ -294,393 +553,988 @@ bool FFmpegEncoder::SetupEncoder(const std::string &output_file) {
         return false;
     }
 
-    video_stream_->codecpar->codec_id = codec->id;
-    video_stream_->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
-    video_stream_->codecpar->width = codec_context_->width;
-    video_stream_->codecpar->height = codec_context_->height;
-    video_stream_->codecpar->format = codec_context_->pix_fmt;
     video_stream_->time_base = (AVRational) {1, AV_TIME_BASE};  // More granular time base
 
-    avcodec_parameters_from_context(video_stream_->codecpar, codec_context_);
+    // Taken from the codec once, the files after the first are set up by the
+    // writing stage while the encode stage may be reopening the codec
+    if (!stream_params_) {
+        stream_params_ = avcodec_parameters_alloc();
+        if (!stream_params_ ||
+            avcodec_parameters_from_context(stream_params_, codec_context_) < 0) {
+            ILOGE("Could not allocate the stream parameters");
+            return false;
+        }
+    }
+    avcodec_parameters_copy(video_stream_->codecpar, stream_params_);
 
     if (!(format_context_->oformat->flags & AVFMT_NOFILE)) {
-        if (avio_open(&format_context_->pb, output_file.c_str(), AVIO_FLAG_WRITE) < 0) {
-            ILOGE("Could not open output file");
+        if (!OpenOutputFile(output_file, &format_context_->pb)) {
             return false;
         }
+        if (output_writer_) {
+            // Keeps avformat_free_context() away from the writer's context
+            format_context_->flags |= AVFMT_FLAG_CUSTOM_IO;
+        }
     }
 
-    if (avformat_write_header(format_context_, nullptr) < 0) {
+    AVDictionary *format_opts = nullptr;
+    if (fragment_ms_ > 0) {
+        av_dict_set(&format_opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        // Caps a fragment should a keyframe come late
+        av_dict_set_int(&format_opts, "frag_duration", fragment_ms_ * int64_t(1000), 0);
+    }
+    int ret = avformat_write_header(format_context_, &format_opts);
+    if (av_dict_count(format_opts) > 0) {
+        ILOGW("Fragmented output is not supported by %s, writing it unfragmented",
+              format_context_->oformat->name);
+    }
+    av_dict_free(&format_opts);
+    if (ret < 0) {
         ILOGE("Error occurred when writing header");
         return false;
     }
+    header_written_ = true;
 
     return true;
 }
 
+bool FFmpegEncoder::SetupAnnexBOutput(const std::string &output_file) {
+    if (codec_context_->codec_id != AV_CODEC_ID_H264) {
+        ILOGE("Annex-B output needs an H.264 encoder");
+        return false;
+    }
+    if (!OpenOutputFile(output_file, &annexb_file_)) {
+        return false;
+    }
+    if ((codec_context_->flags & AV_CODEC_FLAG_GLOBAL_HEADER) &&
+        !H264ParameterSets(codec_context_->extradata, codec_context_->extradata_size,
+                           parameter_sets_)) {
+        // Keyframes must carry them in-band then, as MediaCodec's do
+        ILOGW("No SPS/PPS in the encoder's extradata");
+    }
+    header_written_ = true;
+    return true;
+}
+
+bool FFmpegEncoder::OpenOutputFile(const std::string &output_file, AVIOContext **pb) {
+    if (!buffered_output_ || output_file.find("://") != std::string::npos) {
+        if (avio_open(pb, output_file.c_str(), AVIO_FLAG_WRITE) < 0) {
+            ILOGE("Could not open output file");
+            return false;
+        }
+        return true;
+    }
+
+    AsyncFileWriter::Options options;
+    // Segmented, a file holds one segment
+    double duration_s = segment_s_ > 0 ? segment_s_ : expected_duration_s_;
+    if (duration_s > 0) {
+        // A quarter on top for rate control overshoot and the container
+        options.preallocate = static_cast<int64_t>(bit_rate_.load() / 8 * duration_s * 1.25);
+        if (segment_bytes_ > 0) {
+            options.preallocate = std::min(options.preallocate, segment_bytes_);
+        }
+    }
+    output_writer_.reset(new AsyncFileWriter());
+    if (!output_writer_->Open(output_file, options)) {
+        output_writer_.reset();
+        return false;
+    }
+    *pb = output_writer_->Context();
+    return true;
+}
+
+void FFmpegEncoder::CloseOutputFile(AVIOContext **pb) {
+    if (!output_writer_) {
+        avio_closep(pb);
+        return;
+    }
+    *pb = nullptr;
+    if (!output_writer_->Close()) {
+        ILOGE("Writing the output file failed, it is incomplete");
+    }
+    output_writer_.reset();
+}
+
 static size_t GetBufferSize(AVPixelFormat pf, unsigned int width, unsigned int height) {
     return av_image_get_buffer_size(pf, width, height, 1);
 }
 
 bool FFmpegEncoder::EncodeFrame(const std::string &img) {
     ILOGD("FFmpegEncoder::EncodeFrame - img= %s", img.c_str());
-    // Load the image using FFmpeg
-    AVPixelFormat in_pf = AV_PIX_FMT_BGR24;
-    AVPixelFormat out_pf = AV_PIX_FMT_NV12;
-#if USE_RAW
-/* Warn if the input or output pixelformat is not supported */
-    if (!sws_isSupportedInput(in_pf)) {
-        ILOGE("FFmpegEncoder::EncodeFrame - swscale does not support the input format: %c%c%c%c",
-              (in_pf) & 0xff, ((in_pf) & 0xff), ((in_pf >> 16) & 0xff), ((in_pf >> 24) & 0xff));
+    int64_t submit_us = EncoderCounters::NowUs();
+    stats_.FrameSubmitted();
+    AVFrame *imgFrame;
+    {
+        // Tagged with the number the frame gets once it has loaded
+        TRACE_FRAME_SPAN("load", FrameIndex(next_pts.load()));
+        imgFrame = LoadFrame(img);
     }
-    if (!sws_isSupportedOutput(out_pf)) {
-        ILOGE("FFmpegEncoder::EncodeFrame - swscale does not support the output format: %c%c%c%c",
-              (out_pf) & 0xff, ((out_pf >> 8) & 0xff), ((out_pf >> 16) & 0xff),
-              ((out_pf >> 24) & 0xff));
+    if (!imgFrame) {
+        stats_.FrameDropped();
+        return false;
     }
+    return EncodeSourceFrame(imgFrame, submit_us);
+}
 
-    int alignment = width % 32 ? 1 : 32;
-    /* Check the buffer sizes */
-    size_t needed_insize = GetBufferSize(in_pf, width, height);
-    ILOGD("FFmpegEncoder::EncodeFrame - needed_insize=%ld", needed_insize);
+static void NoRelease(void *, uint8_t *) {
+}
 
-    size_t needed_outsize = GetBufferSize(out_pf, width, height);
-    ILOGD("FFmpegEncoder::EncodeFrame - needed_outsize=%ld", needed_outsize);
+// Opaque of the buffers NoRelease() frees, marks planes the caller still owns
+static char kBorrowedPlanes;
+
+AVFrame *FFmpegEncoder::WrapFrame(const uint8_t *const data[4], const int linesize[4],
+                                  AVPixelFormat format, int frame_width, int frame_height,
+                                  int64_t pts, void (*release)(void *, uint8_t *), void *opaque) {
+    AVFrame *frame = av_frame_alloc();
+    if (!frame) {
+        ILOGE("Could not allocate frame");
+        if (release) {
+            release(opaque, const_cast<uint8_t *>(data[0]));
+        }
+        return nullptr;
+    }
+    if (!WrapPlanes(frame, data, linesize, format, frame_width, frame_height, pts, release,
+                    opaque)) {
+        av_frame_free(&frame);
+        return nullptr;
+    }
+    return frame;
+}
 
-    std::ifstream inFile(img, std::ios::binary | std::ios::ate);
-    if (!inFile.is_open()) {
-        ILOGE("Could not open the image file: %s", img.c_str());
+bool FFmpegEncoder::WrapPlanes(AVFrame *frame, const uint8_t *const data[4],
+                               const int linesize[4], AVPixelFormat format, int frame_width,
+                               int frame_height, int64_t pts, void (*release)(void *, uint8_t *),
+                               void *opaque) {
+    if (!release) {
+        release = NoRelease;
+        opaque = &kBorrowedPlanes;
+    }
+    uint8_t *base = const_cast<uint8_t *>(data[0]);
+
+    // One reference covers every plane, the size is only informative
+    frame->buf[0] = av_buffer_create(base, static_cast<size_t>(linesize[0]) * frame_height,
+                                     release, opaque, AV_BUFFER_FLAG_READONLY);
+    if (!frame->buf[0]) {
+        ILOGE("Could not wrap the caller frame");
+        release(opaque, base);
         return false;
     }
+    for (int i = 0; i < 4; ++i) {
+        frame->data[i] = const_cast<uint8_t *>(data[i]);
+        frame->linesize[i] = linesize[i];
+    }
+    frame->format = format;
+    frame->width = frame_width;
+    frame->height = frame_height;
+    frame->pts = pts;
+    return true;
+}
 
-    std::streamsize size = inFile.tellg();
-    inFile.seekg(0, std::ios::beg);
+AVFrame *FFmpegEncoder::OwnedFrame(AVFrame *frame) {
+    // A converted frame may share a borrowed luma plane through buf[1]
+    bool borrowed = false;
+    for (AVBufferRef *buf : frame->buf) {
+        borrowed = borrowed || (buf && av_buffer_get_opaque(buf) == &kBorrowedPlanes);
+    }
+    if (!borrowed) {
+        return frame;
+    }
+    AVFrame *copy = frame_pool_.Get();
+    if (!copy) {
+        ILOGE("Could not allocate frame");
+        frame_pool_.Put(frame);
+        return nullptr;
+    }
+    copy->format = frame->format;
+    copy->width = frame->width;
+    copy->height = frame->height;
+    if (av_frame_get_buffer(copy, 0) < 0 || av_frame_copy(copy, frame) < 0 ||
+        av_frame_copy_props(copy, frame) < 0) {
+        ILOGE("Could not copy the caller frame");
+        frame_pool_.Put(copy);
+        copy = nullptr;
+    }
+    frame_pool_.Put(frame);
+    return copy;
+}
 
-    std::vector<char> buffer(size);
-    if (!inFile.read(buffer.data(), size)) {
-        ILOGE("Error reading the image file: %s", img.c_str());
+bool FFmpegEncoder::EncodeFrame(const uint8_t *const data[4], const int linesize[4],
+                                AVPixelFormat format, int frame_width, int frame_height,
+                                int64_t pts, void (*release)(void *, uint8_t *), void *opaque) {
+    int64_t submit_us = EncoderCounters::NowUs();
+    stats_.FrameSubmitted();
+    AVFrame *frame = frame_pool_.Get();
+    if (!frame) {
+        ILOGE("Could not allocate frame");
+        if (release) {
+            release(opaque, const_cast<uint8_t *>(data[0]));
+        }
+        stats_.FrameDropped();
         return false;
     }
-
-#if USE_MRS_CODE
-    SwsContext* sws_ctx = nullptr;
-    int new_width = width;
-    int new_height = height;
-    uint8_t* in_buffer = reinterpret_cast<uint8_t *>(buffer.data());
-
-    AVFrame *input_avframe = av_frame_alloc();
-    AVFrame *output_avframe = av_frame_alloc();
-    AVFrame* sw_frame = output_avframe;
-    AVFrame *imgFrame = input_avframe;
-
-    uint codec_imgsize = av_image_get_buffer_size(
-        out_pf, width, height, alignment);
-    ILOGD("FFmpegEncoder::EncodeFrame - buffer size %u from %s(%d) %dx%d, alignment=%d",
-          codec_imgsize, av_get_pix_fmt_name(out_pf), out_pf, width, height, alignment);
-    uint8_t *out_buffer = (uint8_t *)av_malloc(codec_imgsize);
-    ILOGD("FFmpegEncoder::EncodeFrame - sws_getCachedContext(swscale=%p, width=%d, height=%d, in_pf=%d, new_width=%d, new_height=%d, out_pf=%d, SWS_FAST_BILINEAR, nullptr, nullptr, nullptr)"
-            , sws_ctx, width, height, in_pf, new_width, new_height, out_pf);
-    /* Get the context */
-    sws_ctx = sws_getCachedContext(sws_ctx,
-                                       width, height, in_pf,
-                                       new_width, new_height, out_pf,
-                                       SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
-    if (sws_ctx == nullptr) {
-        ILOGE("FFmpegEncoder::EncodeFrame - Failed getting swscale context");
-        return -6;
-    }
-
-    /* Fill in the buffers */
-    ILOGD("FFmpegEncoder::EncodeFrame - av_image_fill_arrays(input_avframe->data=%p, input_avframe->linesize=%d, in_buffer=%p, in_pf=%d, width=%d, height=%d, alignment=%d)"
-            , input_avframe->data, input_avframe->linesize, (uint8_t*)in_buffer, in_pf, width, height, alignment);
-    if (av_image_fill_arrays(input_avframe->data, input_avframe->linesize,
-                             (uint8_t*)in_buffer, in_pf, width, height, alignment) <= 0) {
-        ILOGE("FFmpegEncoder::EncodeFrame - Failed filling input frame with input buffer");
-        return -7;
-    }
-    ILOGD("FFmpegEncoder::EncodeFrame - After calling av_image_fill_arrays, input_avframe:");
-    dump_avframe_info(input_avframe);
-    ILOGD("FFmpegEncoder::EncodeFrame - av_image_fill_arrays(output_avframe->data=%p, output_avframe->linesize=%d, out_buffer=%p, out_pf=%d, width=%d, height=%d, alignment=%d)"
-            , output_avframe->data, output_avframe->linesize, out_buffer, out_pf, new_width, new_height, alignment);
-    if (av_image_fill_arrays(output_avframe->data, output_avframe->linesize,
-                             out_buffer, out_pf, new_width, new_height, alignment) <= 0) {
-        ILOGE("FFmpegEncoder::EncodeFrame - Failed filling output frame with output buffer");
-        return -8;
-    }
-    ILOGD("FFmpegEncoder::EncodeFrame - After calling av_image_fill_arrays, output_avframe:");
-    dump_avframe_info(output_avframe);
-
-    /* Do the conversion */
-    ILOGD("FFmpegEncoder::EncodeFrame - sws_scale(sws_ctx=%p, input_avframe->data=%p, input_avframe->linesize=%d, 0, height=%d, output_avframe->data=%p, output_avframe->linesize=%d)"
-            , sws_ctx, input_avframe->data, input_avframe->linesize, output_avframe->data, output_avframe->linesize);
-    if (!sws_scale(sws_ctx,
-                   input_avframe->data, input_avframe->linesize,
-                   0, height,
-                   output_avframe->data, output_avframe->linesize)) {
-        ILOGE("FFmpegEncoder::EncodeFrame - swscale conversion failed");
-        return -10;
-    }
-    sw_frame->format = out_pf;
-    sw_frame->width = width;
-    sw_frame->height = height;
-#else
-    // Allocate the input AVFrame
-    AVFrame *imgFrame = av_frame_alloc();
-    if (!imgFrame) {
-        ILOGE("Could not allocate image frame");
+    if (!WrapPlanes(frame, data, linesize, format, frame_width, frame_height, pts, release,
+                    opaque)) {
+        frame_pool_.Put(frame);
+        stats_.FrameDropped();
         return false;
     }
+    return EncodeSourceFrame(frame, submit_us);
+}
 
-    imgFrame->format = AV_PIX_FMT_BGR24;
-    imgFrame->width = width;
-    imgFrame->height = height;
-    av_frame_get_buffer(imgFrame, 32);
-
-    // Copy loaded data into imgFrame
-    memcpy(imgFrame->data[0], buffer.data(), buffer.size());
+bool FFmpegEncoder::EncodeSourceFrame(AVFrame *imgFrame, int64_t submit_us) {
+    AssignPts(imgFrame);
+    NumberFrame(imgFrame, submit_us);
+    AVFrame *sw_frame = ConvertFrame(imgFrame);
+    frame_pool_.Put(imgFrame);
+    if (!sw_frame) {
+        stats_.FrameDropped();
+        return false;
+    }
 
-    // Convert the image to NV12 format
-    SwsContext *sws_ctx = sws_getContext(
-            width, height, AV_PIX_FMT_BGR24,
-            width, height, AV_PIX_FMT_NV12,
-            SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+    if (SizeChanged(sw_frame) && !(Flush() && ReopenCodec(sw_frame->width, sw_frame->height))) {
+        frame_pool_.Put(sw_frame);
+        stats_.FrameDropped();
+        return false;
+    }
+    if (DrainsAsync()) {
+        // The codec may keep the frame queued until the drain thread takes the
+        // packet before it, past the point where borrowed planes go back
+        sw_frame = OwnedFrame(sw_frame);
+        if (!sw_frame) {
+            stats_.FrameDropped();
+            return false;
+        }
+    }
+    int64_t encode_start_us = tuner_ ? EncoderCounters::NowUs() : 0;
+    bool sent = SendFrame(sw_frame);
+    frame_pool_.Put(sw_frame);
+    if (!sent) {
+        stats_.FrameDropped();
+        return false;
+    }
+    // With the drain thread the packets are its, report a write it failed
+    bool ok = DrainsAsync() ? !drain_failed_.load() : DrainPackets();
+    if (ok && RetuneDue(EncoderCounters::NowUs() - encode_start_us)) {
+        // Everything the old codec holds goes out before it is replaced
+        ok = Flush() && ReopenCodec();
+    }
+    return ok;
+}
 
-    if (!sws_ctx) {
-        ILOGE("Could not initialize the conversion context");
-        av_frame_free(&imgFrame);
+bool FFmpegEncoder::Flush() {
+    if (DrainsAsync()) {
+        // The drain thread writes what is left and stops at the end of the stream
+        if (!flushed_ && !SendFrame(nullptr)) {
+            return false;
+        }
+        return WaitForDrain();
+    }
+    if (flushed_) {
+        return true;
+    }
+    if (!SendFrame(nullptr)) {
         return false;
     }
+    return DrainPackets();
+}
 
-    AVFrame *sw_frame = av_frame_alloc();
-    sw_frame->format = AV_PIX_FMT_NV12;
-    sw_frame->width = width;
-    sw_frame->height = height;
-    av_frame_get_buffer(sw_frame, 32);
+void FFmpegEncoder::SetConvertBands(int bands) {
+    converter_.SetBands(bands);
+}
 
-    ILOGD("FFmpegEncoder::EncodeFrame - imgFrame:");
-    dump_avframe_info(imgFrame);
-    ILOGD("FFmpegEncoder::EncodeFrame - sw_frame:");
-    dump_avframe_info(sw_frame);
+void FFmpegEncoder::SetWorkerPool(WorkerPool *pool) {
+    worker_pool_ = pool;
+    converter_.SetWorkerPool(pool);
+}
 
-    sws_scale(sws_ctx, imgFrame->data, imgFrame->linesize, 0, height, sw_frame->data,
-              sw_frame->linesize);
-#endif
+WorkerPool &FFmpegEncoder::Workers() const {
+    return worker_pool_ ? *worker_pool_ : WorkerPool::Shared();
+}
 
-    // Load and encode image...
-    AVPacket pkt;
-    av_init_packet(&pkt);
-#else
-    AVFormatContext* imgFormatContext = nullptr;
-    if (avformat_open_input(&imgFormatContext, img.c_str(), nullptr, nullptr) != 0) {
-      ILOGE("Could not open the image file: %s", img.c_str() );
-      return false;
+void FFmpegEncoder::SetCodecThreads(int threads) {
+    codec_threads_ = threads;
+}
+
+void FFmpegEncoder::SetDrainThread(bool enabled) {
+    use_drain_thread_ = enabled;
+}
+
+void FFmpegEncoder::SetBufferedOutput(bool enabled) {
+    buffered_output_ = enabled;
+}
+
+void FFmpegEncoder::SetExpectedDuration(double seconds) {
+    expected_duration_s_ = seconds;
+}
+
+void FFmpegEncoder::SetFragmentedOutput(int fragment_ms) {
+    fragment_ms_ = std::max(fragment_ms, 0);
+}
+
+void FFmpegEncoder::SetAnnexBOutput(bool enabled) {
+    annexb_output_ = enabled;
+}
+
+void FFmpegEncoder::SetLiveMode(bool enabled, int latency_budget_ms) {
+    live_mode_ = enabled;
+    stats_.SetLatencyBudget(enabled ? latency_budget_ms * int64_t(1000) : 0);
+}
+
+void FFmpegEncoder::EnableRuntimeBitrate(bool enabled) {
+    if (enabled && encoder_type_ != EncoderType::LIBX264) {
+        ILOGW("Only libx264 can change the bitrate while it runs");
+        return;
     }
+    runtime_bitrate_ = enabled;
+}
 
-    if (avformat_find_stream_info(imgFormatContext, nullptr) < 0) {
-      ILOGE("Could not find stream information in the image file" );
-      avformat_close_input(&imgFormatContext);
-      return false;
+bool FFmpegEncoder::SetBitrate(int64_t bits_per_second) {
+    if (bits_per_second <= 0) {
+        return false;
     }
+    if (codec_opened_.load() && !runtime_bitrate_) {
+        ILOGW("Cannot change the bitrate while encoding, see EnableRuntimeBitrate()");
+        return false;
+    }
+    bit_rate_ = bits_per_second;
+    bitrate_changed_ = true;
+    return true;
+}
 
-    const AVCodec* imgCodec = avcodec_find_decoder(imgFormatContext->streams[0]->codecpar->codec_id);
-    if (!imgCodec) {
-      ILOGE("Unsupported codec for image" );
-      avformat_close_input(&imgFormatContext);
-      return false;
+void FFmpegEncoder::RequestKeyframe() {
+    keyframe_requested_ = true;
+}
+
+void FFmpegEncoder::SetFrameRate(double fps) {
+    if (fps > 0) {
+        requested_increment_ = static_cast<int64_t>(AV_TIME_BASE / fps + 0.5);
     }
+}
 
-    AVCodecContext* imgCodecContext = avcodec_alloc_context3(imgCodec);
-    if (!imgCodecContext) {
-      ILOGE("Could not allocate image codec context" );
-      avformat_close_input(&imgFormatContext);
-      return false;
+void FFmpegEncoder::SetTargetFps(double fps) {
+    target_fps_ = fps;
+}
+
+void FFmpegEncoder::SetSegmentedOutput(double segment_s, int64_t segment_bytes,
+                                       const std::string &playlist) {
+    segment_s_ = std::max(segment_s, 0.0);
+    segment_bytes_ = std::max<int64_t>(segment_bytes, 0);
+    playlist_path_ = playlist;
+}
+
+void FFmpegEncoder::SetResolution(int frame_width, int frame_height) {
+    // 4:2:0 needs even sizes
+    if (frame_width < 2 || frame_height < 2 || frame_width % 2 || frame_height % 2) {
+        ILOGW("Ignoring invalid resolution %dx%d", frame_width, frame_height);
+        return;
     }
+    output_size_ = PackSize(frame_width, frame_height);
+}
 
-    if (avcodec_open2(imgCodecContext, imgCodec, nullptr) < 0) {
-      ILOGE("Could not open image codec" );
-      avformat_close_input(&imgFormatContext);
-      return false;
+void FFmpegEncoder::SetRawInputSize(int frame_width, int frame_height) {
+    if (frame_width <= 0 || frame_height <= 0) {
+        ILOGW("Ignoring invalid input size %dx%d", frame_width, frame_height);
+        return;
     }
+    raw_input_size_ = PackSize(frame_width, frame_height);
+}
 
-    // Load and encode image...
-    AVPacket pkt;
-    av_init_packet(&pkt);
+void FFmpegEncoder::PrefetchFrame(const std::string &img) {
+#if USE_RAW
+    PrefetchRawFrame(img);
+#endif
+}
 
-    // Read the frame from the image file
-    if (av_read_frame(imgFormatContext, &pkt) < 0) {
-      ILOGE("Failed to read frame from image file" );
-      av_packet_unref(&pkt);
-      avcodec_free_context(&imgCodecContext);
-      avformat_close_input(&imgFormatContext);
-      return false;
+AVFrame *FFmpegEncoder::LoadFrame(const std::string &img) {
+    return LoadFrame(img, decoder_);
+}
+
+AVFrame *FFmpegEncoder::LoadFrame(const std::string &img,
+                                  [[maybe_unused]] JpegDecoder &decoder) {
+#if USE_RAW
+    AVPixelFormat in_pf = AV_PIX_FMT_BGR24;
+    /* Warn if the input pixelformat is not supported */
+    if (!sws_isSupportedInput(in_pf)) {
+        ILOGE("FFmpegEncoder::LoadFrame - swscale does not support the input format: %s",
+              av_get_pix_fmt_name(in_pf));
     }
 
-    // Send the packet to the decoder
-    if (avcodec_send_packet(imgCodecContext, &pkt) < 0) {
-      ILOGE("Error sending a packet for decoding" );
-      av_packet_unref(&pkt);
-      avcodec_free_context(&imgCodecContext);
-      avformat_close_input(&imgFormatContext);
-      return false;
+    // Loaded on several threads at once, none of them touches the codec's size
+    int64_t input_size = raw_input_size_.load();
+    int in_width = SizeWidth(input_size);
+    int in_height = SizeHeight(input_size);
+    int alignment = in_width % 32 ? 1 : 32;
+    /* Check the buffer sizes */
+    size_t needed_insize = GetBufferSize(in_pf, in_width, in_height);
+    ILOGD("FFmpegEncoder::LoadFrame - needed_insize=%ld", needed_insize);
+
+    // Map the file and use the mapping as the source plane, no copy
+    AVBufferRef *buffer = MapRawFrame(img, needed_insize);
+    if (!buffer) {
+        return nullptr;
     }
 
-    // Allocate an AVFrame to hold the decoded image
-    AVFrame* imgFrame = av_frame_alloc();
+    AVFrame *imgFrame = frame_pool_.Get();
     if (!imgFrame) {
-      ILOGE("Could not allocate image frame" );
-      av_packet_unref(&pkt);
-      avcodec_free_context(&imgCodecContext);
-      avformat_close_input(&imgFormatContext);
-      return false;
+        ILOGE("Could not allocate image frame");
+        av_buffer_unref(&buffer);
+        return nullptr;
     }
+    imgFrame->buf[0] = buffer;
 
-    // Receive the frame from the decoder
-    if (avcodec_receive_frame(imgCodecContext, imgFrame) < 0) {
-      ILOGE("Error during decoding" );
-      av_frame_free(&imgFrame);
-      av_packet_unref(&pkt);
-      avcodec_free_context(&imgCodecContext);
-      avformat_close_input(&imgFormatContext);
-      return false;
+    if (av_image_fill_arrays(imgFrame->data, imgFrame->linesize,
+                             buffer->data, in_pf, in_width, in_height, alignment) <= 0) {
+        ILOGE("FFmpegEncoder::LoadFrame - Failed filling input frame with input buffer");
+        frame_pool_.Put(imgFrame);
+        return nullptr;
     }
+    imgFrame->format = in_pf;
+    imgFrame->width = in_width;
+    imgFrame->height = in_height;
 
-    // Convert the image to the correct format
-    SwsContext* sws_ctx = sws_getContext(
-        imgCodecContext->width, imgCodecContext->height, imgCodecContext->pix_fmt,
-        codec_context_->width, codec_context_->height, AV_PIX_FMT_NV12,
-        SWS_BILINEAR, nullptr, nullptr, nullptr);
-    if (!sws_ctx) {
-      ILOGE("Could not initialize the conversion context" );
-      av_frame_free(&imgFrame);
-      av_packet_unref(&pkt);
-      avcodec_free_context(&imgCodecContext);
-      avformat_close_input(&imgFormatContext);
-      return false;
+    ILOGD("FFmpegEncoder::LoadFrame - After calling av_image_fill_arrays, imgFrame:");
+    dump_avframe_info(imgFrame);
+    return imgFrame;
+#else
+    // The decoder stays open across images, no per-image probe or codec open
+    AVFrame *imgFrame = frame_pool_.Get();
+    if (!imgFrame) {
+        ILOGE("Could not allocate image frame");
+        return nullptr;
     }
-
-    // Convert and encode the frame
-    AVFrame* sw_frame = av_frame_alloc();
-    sw_frame->format = AV_PIX_FMT_NV12;
-    sw_frame->width = codec_context_->width;
-    sw_frame->height = codec_context_->height;
-    if (av_frame_get_buffer(sw_frame, 32) < 0) {
-      ILOGE("Could not allocate frame buffer" );
-      sws_freeContext(sws_ctx);
-      av_frame_free(&sw_frame);
-      av_frame_free(&imgFrame);
-      av_packet_unref(&pkt);
-      avcodec_free_context(&imgCodecContext);
-      avformat_close_input(&imgFormatContext);
-      return false;
+    if (!decoder.Decode(img, imgFrame)) {
+        frame_pool_.Put(imgFrame);
+        return nullptr;
     }
+    return imgFrame;
+#endif
+}
+
+AVFrame *FFmpegEncoder::ConvertFrame(const AVFrame *imgFrame) {
+    TRACE_FRAME_SPAN("convert", FrameIndex(imgFrame->pts));
+    AVPixelFormat in_pf = static_cast<AVPixelFormat>(imgFrame->format);
+    // Convert to what the encoder was opened with and the size asked for, the
+    // encode stage reopens the codec when they differ. Neither is read from
+    // the codec, the encode thread may be reopening it. Input that already
+    // matches is passed through.
+    AVPixelFormat out_pf = static_cast<AVPixelFormat>(convert_format_.load());
+    int64_t out_size = output_size_.load();
 
-    sws_scale(sws_ctx, imgFrame->data, imgFrame->linesize, 0, codec_context_->height, sw_frame->data, sw_frame->linesize);
+#if USE_RAW
+    int flags = SWS_FAST_BILINEAR;
+#else
+    int flags = SWS_BILINEAR;
 #endif
+    // Scaler and output buffers are cached by the converter across frames
+    AVFrame *sw_frame = converter_.Convert(imgFrame, out_pf,
+                                           SizeWidth(out_size), SizeHeight(out_size), flags);
+    if (!sw_frame) {
+        ILOGE("FFmpegEncoder::ConvertFrame - conversion from %s failed", av_get_pix_fmt_name(in_pf));
+        return nullptr;
+    }
+    sw_frame->pts = imgFrame->pts;
+    sw_frame->opaque = imgFrame->opaque;
 
-    // Set PTS for the frame
-    sw_frame->pts = next_pts;
-    next_pts += pts_increment;
+    ILOGD("FFmpegEncoder::ConvertFrame - sw_frame:");
+    dump_avframe_info(sw_frame);
+    return sw_frame;
+}
+
+bool FFmpegEncoder::SendFrame(AVFrame *sw_frame) {
+    if (!sw_frame) {
+        // Enter draining mode, the remaining packets come out of ReceivePacket()
+        flushed_ = true;
+        if (SendToCodec(nullptr) < 0) {
+            ILOGE("Error flushing the encoder");
+            return false;
+        }
+        return true;
+    }
+
+    // Set PTS for the frame unless the caller already did
+    AssignPts(sw_frame);
 
 #ifdef SUPPORT_HW_ENCODER
     // Create a hardware frame for encoding
-    AVFrame* hw_frame = av_frame_alloc();
+    AVFrame* hw_frame = frame_pool_.Get();
     // hw_frame->format = AV_PIX_FMT_VAAPI;
     hw_frame->format = AV_PIX_FMT_YUV420P;
     hw_frame->width = codec_context_->width;
     hw_frame->height = codec_context_->height;
     hw_frame->pts = sw_frame->pts;
+    hw_frame->opaque = sw_frame->opaque;
 
+    TRACE_NAMED_SPAN(upload_span, "hw_upload");
+    TRACE_SET_FRAME(upload_span, FrameIndex(sw_frame->pts));
     if (av_hwframe_get_buffer(codec_context_->hw_frames_ctx, hw_frame, 0) < 0) {
       ILOGE("Failed to allocate VAAPI frame." );
-      sws_freeContext(sws_ctx);
-      av_frame_free(&hw_frame);
-      av_frame_free(&sw_frame);
-      av_frame_free(&imgFrame);
-      av_packet_unref(&pkt);
-      avcodec_free_context(&imgCodecContext);
-      avformat_close_input(&imgFormatContext);
+      frame_pool_.Put(hw_frame);
       return false;
     }
 
     // Transfer the data from sw_frame to hw_frame
     if (av_hwframe_transfer_data(hw_frame, sw_frame, 0) < 0) {
       ILOGE("Error transferring frame data to VAAPI surface." );
-      sws_freeContext(sws_ctx);
-      av_frame_free(&hw_frame);
-      av_frame_free(&sw_frame);
-      av_frame_free(&imgFrame);
-      av_packet_unref(&pkt);
-      avcodec_free_context(&imgCodecContext);
-      avformat_close_input(&imgFormatContext);
+      frame_pool_.Put(hw_frame);
       return false;
     }
 
     // Encode the frame
-    if (avcodec_send_frame(codec_context_, hw_frame) < 0) {
+    TRACE_FRAME_SPAN("send_frame", FrameIndex(sw_frame->pts));
+    if (SendToCodec(hw_frame) < 0) {
       ILOGE("Error sending the frame to the hardware encoder" );
-      sws_freeContext(sws_ctx);
-      av_frame_free(&hw_frame);
-      av_frame_free(&sw_frame);
-      av_frame_free(&imgFrame);
-      av_packet_unref(&pkt);
-      avcodec_free_context(&imgCodecContext);
-      avformat_close_input(&imgFormatContext);
+      frame_pool_.Put(hw_frame);
       return false;
     }
+    frame_pool_.Put(hw_frame);
 #else
-
-    ILOGD("FFmpegEncoder::EncodeFrame - Before sending to encoder, sw_frame:");
+    ILOGD("FFmpegEncoder::SendFrame - Before sending to encoder, sw_frame:");
     dump_avframe_info(sw_frame);
 
     // Fallback to software encoding
-    if (avcodec_send_frame(codec_context_, sw_frame) < 0) {
+    TRACE_FRAME_SPAN("send_frame", FrameIndex(sw_frame->pts));
+    if (SendToCodec(sw_frame) < 0) {
         ILOGE("Error sending the sw_frame to the encoder");
-        sws_freeContext(sws_ctx);
-        av_frame_free(&sw_frame);
-        av_frame_free(&imgFrame);
-        av_packet_unref(&pkt);
-#if !(USE_RAW)
-        avcodec_free_context(&imgCodecContext);
-        avformat_close_input(&imgFormatContext);
-#endif
         return false;
     }
 #endif
+    return true;
+}
 
-    // Receive and write the encoded packet
-    auto ret = 0;
-    while (ret >= 0) {
-        ILOGD("avcodec_receive_packet");
-        ret = avcodec_receive_packet(codec_context_, &pkt);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-            break;
-        } else if (ret < 0) {
-            ILOGE("Error during encoding");
-            break;
+int FFmpegEncoder::ReceivePacket(AVPacket *pkt) {
+    ILOGD("avcodec_receive_packet");
+    TRACE_NAMED_SPAN(span, "receive_packet");
+    int ret = avcodec_receive_packet(codec_context_, pkt);
+    if (ret >= 0) {
+        TRACE_SET_FRAME(span, FrameIndex(pkt->pts));
+        PacketEncoded(pkt);
+    }
+    if (ret >= 0 && codec_reopened_) {
+        // The writing stage switches to the new SPS/PPS, or to a file with
+        // the new size, at this packet
+        codec_reopened_ = false;
+        if (annexb_output_ && codec_context_->extradata_size > 0) {
+            uint8_t *side = av_packet_new_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA,
+                                                    codec_context_->extradata_size);
+            if (side) {
+                memcpy(side, codec_context_->extradata, codec_context_->extradata_size);
+            }
+        }
+        uint8_t *change = Segmented() && !annexb_output_
+                          ? av_packet_new_side_data(pkt, AV_PKT_DATA_PARAM_CHANGE, 12) : nullptr;
+        if (change) {
+            AV_WL32(change, AV_SIDE_DATA_PARAM_CHANGE_DIMENSIONS);
+            AV_WL32(change + 4, width);
+            AV_WL32(change + 8, height);
         }
+    }
+    if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+        ILOGE("Error during encoding");
+    }
+    return ret;
+}
 
-        // Write the encoded packet to the file
-        av_interleaved_write_frame(format_context_, &pkt);
-        av_packet_unref(&pkt);
+bool FFmpegEncoder::WritePacket(AVPacket *pkt) {
+    if (Segmented() && !CheckSegment(pkt)) {
+        av_packet_unref(pkt);
+        return false;
+    }
+    if (annexb_file_) {
+        return WriteAnnexBPacket(pkt);
     }
+    TRACE_FRAME_SPAN("write_packet", FrameIndex(pkt->pts));
+    pkt->stream_index = video_stream_->index;
+    if (segment_offset_ != 0) {
+        if (pkt->pts != AV_NOPTS_VALUE) {
+            pkt->pts -= segment_offset_;
+        }
+        if (pkt->dts != AV_NOPTS_VALUE) {
+            pkt->dts -= segment_offset_;
+        }
+    }
+    // SetupEncoder() always uses AV_TIME_BASE_Q. Not read from the codec, the
+    // mux thread would race a ReopenCodec() on the encode thread.
+    av_packet_rescale_ts(pkt, AV_TIME_BASE_Q, video_stream_->time_base);
+    if (pkt->dts != AV_NOPTS_VALUE && last_dts_ != AV_NOPTS_VALUE && pkt->dts <= last_dts_) {
+        // A reopened codec with B-frames starts its dts a frame early
+        pkt->dts = last_dts_ + 1;
+    }
+    last_dts_ = pkt->dts;
+
+    // A single stream has nothing to interleave. av_write_frame() skips the
+    // packet list entry av_interleaved_write_frame() allocates per packet,
+    // and leaves the reference with us.
+    int size = pkt->size;
+    int ret = av_write_frame(format_context_, pkt);
+    av_packet_unref(pkt);
+    if (ret < 0) {
+        ILOGE("Error writing the encoded packet");
+        return false;
+    }
+    stats_.PacketMuxed(size);
+    return true;
+}
 
-    // Cleanup
-    sws_freeContext(sws_ctx);
-#ifdef SUPPORT_HW_ENCODER
-    av_frame_free(&hw_frame);
-#endif
-    av_frame_free(&sw_frame);
-    av_frame_free(&imgFrame);
-    av_packet_unref(&pkt);
-#if !(USE_RAW)
-    avcodec_free_context(&imgCodecContext);
-    avformat_close_input(&imgFormatContext);
-#endif
+bool FFmpegEncoder::ReopenCodec(int frame_width, int frame_height) {
+    if (frame_width > 0 && frame_height > 0) {
+        ILOGI("Reopening the encoder at %dx%d", frame_width, frame_height);
+        width = frame_width;
+        height = frame_height;
+    }
+    if (tuner_) {
+        const CodecSettings &settings = tuner_->Current();
+        ILOGI("Reopening libx264 with preset %s, %d %s threads", settings.preset,
+              settings.threads, settings.thread_type == FF_THREAD_FRAME ? "frame" : "slice");
+    }
+    // The drain thread is idle at the end of the old stream, keep it there
+    std::unique_lock<std::mutex> lock(codec_mutex_, std::defer_lock);
+    if (DrainsAsync()) {
+        lock.lock();
+    }
+    avcodec_free_context(&codec_context_);
+    // Payloads still queued for the muxer are freed when they come back
+    av_buffer_pool_uninit(&packet_buffers_);
+    flushed_ = false;
+    drain_eof_ = false;
+    if (!SetupEncoder()) {
+        return false;
+    }
+    codec_reopened_ = (annexb_output_ && codec_context_->extradata_size > 0) ||
+                      (Segmented() && !annexb_output_);
+    return true;
+}
+
+std::string FFmpegEncoder::SegmentPath(int index) const {
+    char name[1024];
+    if (output_pattern_.find('%') != std::string::npos) {
+        snprintf(name, sizeof(name), output_pattern_.c_str(), index);
+        return name;
+    }
+    size_t slash = output_pattern_.find_last_of('/');
+    size_t dot = output_pattern_.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = output_pattern_.size();
+    }
+    snprintf(name, sizeof(name), "_%05d", index);
+    return output_pattern_.substr(0, dot) + name + output_pattern_.substr(dot);
+}
+
+bool FFmpegEncoder::CheckSegment(const AVPacket *pkt) {
+    if (segment_failed_) {
+        return false;
+    }
+    // Set by ReceivePacket() at the first packet of a reopened codec
+    int new_width = 0;
+    int new_height = 0;
+    size_t size = 0;
+    const uint8_t *change = av_packet_get_side_data(pkt, AV_PKT_DATA_PARAM_CHANGE, &size);
+    if (change && size >= 12 && (AV_RL32(change) & AV_SIDE_DATA_PARAM_CHANGE_DIMENSIONS)) {
+        new_width = static_cast<int>(AV_RL32(change + 4));
+        new_height = static_cast<int>(AV_RL32(change + 8));
+    }
+    bool resized = new_width > 0 &&
+                   (new_width != stream_params_->width || new_height != stream_params_->height);
+
+    bool key = pkt->flags & AV_PKT_FLAG_KEY;
+    if (segment_start_pts_ == AV_NOPTS_VALUE) {
+        segment_start_pts_ = pkt->pts;
+    } else if (!segment_due_ &&
+               ((segment_s_ > 0 && pkt->pts - segment_start_pts_ >= segment_s_ * AV_TIME_BASE) ||
+                (segment_bytes_ > 0 && segment_size_ >= segment_bytes_))) {
+        segment_due_ = true;
+        if (!key) {
+            // The GOP may be long (or all intra refresh), do not wait for it
+            RequestKeyframe();
+        }
+    }
+    if ((segment_due_ && key) || resized) {
+        if (!RollSegment(pkt, resized ? new_width : 0, new_height)) {
+            return false;
+        }
+    }
+
+    int64_t duration = pkt->duration > 0 ? pkt->duration : FrameDuration(pkt->pts);
+    if (segment_end_pts_ == AV_NOPTS_VALUE || pkt->pts + duration > segment_end_pts_) {
+        segment_end_pts_ = pkt->pts + duration;
+    }
+    segment_size_ += pkt->size;
+    return true;
+}
+
+bool FFmpegEncoder::RollSegment(const AVPacket *pkt, int new_width, int new_height) {
+    TRACE_SPAN("roll_segment");
+    // MPEG-TS segments of a playlist keep one timeline, other files start at 0
+    bool continuous = format_context_ && strcmp(format_context_->oformat->name, "mpegts") == 0;
+    // The finished file is written out here, the packets keep queueing meanwhile
+    bool trailer_written = WriteTrailer();
+    FinishSegment(pkt->pts, false);
+
+    segment_index_++;
+    segment_start_pts_ = pkt->pts;
+    segment_end_pts_ = AV_NOPTS_VALUE;
+    segment_size_ = 0;
+    segment_due_ = false;
+    std::string path = SegmentPath(segment_index_);
+    ILOGI("Starting segment %s", path.c_str());
+    if (annexb_output_) {
+        // Parameter sets go in front of the keyframe, the file plays on its own
+        segment_failed_ = !OpenOutputFile(path, &annexb_file_);
+        header_written_ = !segment_failed_;
+        return trailer_written && !segment_failed_;
+    }
+
+    if (new_width > 0) {
+        stream_params_->width = new_width;
+        stream_params_->height = new_height;
+    }
+    if (!continuous) {
+        segment_offset_ = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    }
+    last_dts_ = AV_NOPTS_VALUE;
+    segment_failed_ = !OpenVideoFile(path) || !SetupOutput(path);
+    return trailer_written && !segment_failed_;
+}
 
+void FFmpegEncoder::FinishSegment(int64_t end_pts, bool last) {
+    if (annexb_file_) {
+        CloseOutputFile(&annexb_file_);
+    } else if (format_context_ && !last) {
+        // Set again once the next file has its header
+        header_written_ = false;
+        if (!(format_context_->oformat->flags & AVFMT_NOFILE)) {
+            CloseOutputFile(&format_context_->pb);
+        }
+        avformat_free_context(format_context_);
+        format_context_ = nullptr;
+        video_stream_ = nullptr;
+    }
+    std::string path = SegmentPath(segment_index_);
+    size_t slash = path.find_last_of('/');
+    double duration = end_pts != AV_NOPTS_VALUE
+                      ? static_cast<double>(end_pts - segment_start_pts_) / AV_TIME_BASE : 0;
+    segments_.push_back({slash == std::string::npos ? path : path.substr(slash + 1), duration});
+    WritePlaylist(last);
+}
+
+bool FFmpegEncoder::WritePlaylist(bool ended) {
+    if (playlist_path_.empty()) {
+        return true;
+    }
+    double longest = 0;
+    for (const auto &segment : segments_) {
+        longest = std::max(longest, segment.duration);
+    }
+    // Written next to it and renamed over it, a player never reads half of it
+    std::string temp_path = playlist_path_ + ".tmp";
+    FILE *file = fopen(temp_path.c_str(), "w");
+    if (!file) {
+        ILOGE("Could not open %s", temp_path.c_str());
+        return false;
+    }
+    fprintf(file, "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:%d\n"
+                  "#EXT-X-MEDIA-SEQUENCE:0\n#EXT-X-PLAYLIST-TYPE:EVENT\n",
+            static_cast<int>(std::ceil(longest)));
+    for (const auto &segment : segments_) {
+        fprintf(file, "#EXTINF:%.3f,\n%s\n", segment.duration, segment.name.c_str());
+    }
+    if (ended) {
+        fprintf(file, "#EXT-X-ENDLIST\n");
+    }
+    bool ok = fclose(file) == 0 && rename(temp_path.c_str(), playlist_path_.c_str()) == 0;
+    if (!ok) {
+        ILOGE("Could not write the playlist %s", playlist_path_.c_str());
+    }
+    return ok;
+}
+
+bool FFmpegEncoder::WriteAnnexBPacket(AVPacket *pkt) {
+    TRACE_FRAME_SPAN("write_packet", FrameIndex(pkt->pts));
+    size_t side_size = 0;
+    const uint8_t *side = av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &side_size);
+    if (side && !H264ParameterSets(side, static_cast<int>(side_size), parameter_sets_)) {
+        ILOGW("No SPS/PPS in the reopened encoder's extradata");
+    }
+    int size = pkt->size;
+    if ((pkt->flags & AV_PKT_FLAG_KEY) && !parameter_sets_.empty() &&
+        !H264HasParameterSets(pkt->data, pkt->size)) {
+        avio_write(annexb_file_, parameter_sets_.data(), static_cast<int>(parameter_sets_.size()));
+        size += static_cast<int>(parameter_sets_.size());
+    }
+    avio_write(annexb_file_, pkt->data, pkt->size);
+    av_packet_unref(pkt);
+    if (annexb_file_->error < 0) {
+        ILOGE("Error writing the encoded packet");
+        return false;
+    }
+    stats_.PacketMuxed(size);
     return true;
 }
 
+void FFmpegEncoder::ApplyControls(AVFrame *frame) {
+    if (bitrate_changed_.exchange(false) && runtime_bitrate_) {
+        // libx264 reconfigures itself when it sees these differ on the next frame
+        int64_t bit_rate = bit_rate_.load();
+        codec_context_->bit_rate = bit_rate;
+        codec_context_->rc_max_rate = bit_rate;
+        codec_context_->rc_buffer_size = static_cast<int>(bit_rate);
+    }
+    if (frame && keyframe_requested_.exchange(false)) {
+        frame->pict_type = AV_PICTURE_TYPE_I;
+    }
+}
+
+void FFmpegEncoder::AssignPts(AVFrame *frame) {
+    if (frame->pts != AV_NOPTS_VALUE) {
+        return;
+    }
+    int64_t increment = requested_increment_.exchange(0);
+    if (increment > 0 && increment != pts_increment) {
+        // Frames from the next pts on are numbered at the new rate
+        int64_t pts = next_pts.load();
+        int count = rate_change_count_.load(std::memory_order_relaxed);
+        RateChange &change = rate_changes_[count % kRateChanges];
+        change.index.store(FrameIndex(pts), std::memory_order_relaxed);
+        change.pts.store(pts, std::memory_order_relaxed);
+        change.increment.store(increment, std::memory_order_relaxed);
+        rate_change_count_.store(count + 1, std::memory_order_release);
+        pts_increment = increment;
+    }
+    frame->pts = next_pts.fetch_add(pts_increment);
+}
+
+void FFmpegEncoder::NumberFrame(AVFrame *frame, int64_t submit_us) {
+    int64_t sequence = stats_.FrameNumbered(frame->pts, submit_us);
+    // Offset by one, a null opaque is a frame that was never numbered
+    frame->opaque = reinterpret_cast<void *>(static_cast<intptr_t>(sequence + 1));
+}
+
+void FFmpegEncoder::PacketEncoded(const AVPacket *pkt) {
+    // Without AV_CODEC_FLAG_COPY_OPAQUE the frame is found by its pts instead
+    int64_t sequence = pkt->opaque ? reinterpret_cast<intptr_t>(pkt->opaque) - 1 : -1;
+    stats_.PacketEncoded(sequence, pkt->pts, pkt->flags & AV_PKT_FLAG_KEY);
+}
+
+int64_t FFmpegEncoder::FrameIndex(int64_t pts) const {
+    if (pts == AV_NOPTS_VALUE) {
+        return -1;
+    }
+    int count = rate_change_count_.load(std::memory_order_acquire);
+    for (int i = count - 1; i >= 0 && i >= count - kRateChanges; --i) {
+        const RateChange &change = rate_changes_[i % kRateChanges];
+        int64_t start = change.pts.load(std::memory_order_relaxed);
+        if (pts >= start) {
+            return change.index.load(std::memory_order_relaxed) +
+                   (pts - start) / change.increment.load(std::memory_order_relaxed);
+        }
+    }
+    // Older than the changes kept, a trace label or a latency sample is lost
+    return -1;
+}
+
+int64_t FFmpegEncoder::FrameDuration(int64_t pts) const {
+    int count = rate_change_count_.load(std::memory_order_acquire);
+    for (int i = count - 1; i > 0 && i > count - kRateChanges; --i) {
+        const RateChange &change = rate_changes_[i % kRateChanges];
+        if (pts >= change.pts.load(std::memory_order_relaxed)) {
+            return change.increment.load(std::memory_order_relaxed);
+        }
+    }
+    // Before the changes kept, the oldest one is the closest
+    int oldest = std::max(count - kRateChanges, 0);
+    return rate_changes_[oldest % kRateChanges].increment.load(std::memory_order_relaxed);
+}
+
+bool FFmpegEncoder::DrainPackets() {
+    // Receive and write the encoded packets
+    bool ok = true;
+    int ret = 0;
+    while ((ret = ReceivePacket(packet_)) >= 0) {
+        ok = WritePacket(packet_) && ok;
+    }
+
+    return ok && (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF);
+}
+
+int FFmpegEncoder::SendToCodec(AVFrame *frame) {
+    if (!codec_context_) {
+        // A ReopenCodec() failed
+        return AVERROR(EINVAL);
+    }
+    if (!DrainsAsync()) {
+        ApplyControls(frame);
+        return avcodec_send_frame(codec_context_, frame);
+    }
+
+    std::unique_lock<std::mutex> lock(codec_mutex_);
+    ApplyControls(frame);
+    int ret;
+    // EAGAIN: the codec still holds a packet, let the drain thread take it
+    while ((ret = avcodec_send_frame(codec_context_, frame)) == AVERROR(EAGAIN) &&
+           !drain_failed_.load()) {
+        drain_requested_ = true;
+        drain_cv_.notify_one();
+        drained_cv_.wait(lock);
+    }
+    drain_requested_ = true;
+    lock.unlock();
+    drain_cv_.notify_one();
+    return ret;
+}
+
+void FFmpegEncoder::DrainLoop() {
+    Tracer::SetThreadName("drain");
+    std::unique_lock<std::mutex> lock(codec_mutex_);
+    while (true) {
+        drain_cv_.wait(lock, [this] { return drain_requested_ || drain_stop_; });
+        if (!drain_requested_) {
+            return;
+        }
+        drain_requested_ = false;
+
+        int ret;
+        while ((ret = ReceivePacket(packet_)) >= 0) {
+            drained_cv_.notify_all();
+            // The codec is free for the next frame while the muxer writes
+            lock.unlock();
+            bool written = WritePacket(packet_);
+            lock.lock();
+            if (!written) {
+                drain_failed_ = true;
+            }
+        }
+        if (ret == AVERROR_EOF) {
+            drain_eof_ = true;
+        } else if (ret != AVERROR(EAGAIN)) {
+            drain_failed_ = true;
+        }
+        drained_cv_.notify_all();
+    }
+}
+
+bool FFmpegEncoder::WaitForDrain() {
+    std::unique_lock<std::mutex> lock(codec_mutex_);
+    drained_cv_.wait(lock, [this] { return drain_eof_ || drain_failed_.load(); });
+    return !drain_failed_.load();
+}
+
+void FFmpegEncoder::StopDrainThread() {
+    if (!drain_thread_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(codec_mutex_);
+        drain_stop_ = true;
+    }
+    drain_cv_.notify_one();
+    drain_thread_.join();
+}
+
 bool FFmpegEncoder::WriteTrailer() {
+    if (annexb_file_) {
+        avio_flush(annexb_file_);
+        return annexb_file_->error >= 0;
+    }
     if (av_write_trailer(format_context_) < 0) {
         ILOGE("Error occurred when writing trailer");
         return false;
@@ -11,11 +11,25 @@ extern "C" {
 #include <libswscale/swscale.h>
 }
 
+#include "async_file_writer.h"
+#include "av_object_pool.h"
+#include "encoder_stats.h"
+#include "encoder_tuner.h"
+#include "frame_converter.h"
+#include "jpeg_decoder.h"
+
+#include <atomic>
+#include <condition_variable>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #define USE_RAW 1
+// Run load/convert/encode/mux on separate threads, see EncodePipeline
+#define USE_PIPELINE 1
 
 // #define SUPPORT_HW_ENCODER
 
@@ -26,9 +40,131 @@ class FFmpegEncoder {
   FFmpegEncoder(EncoderType pEncoderType, int pWidth, int pHeight, int pQuality=4, int pFps=30);
   ~FFmpegEncoder();
   bool Initialize(const std::string& output_file);
+  // Open only the codec, with closed GOPs and no output file. The packets
+  // are collected by the caller, see ChunkedEncoder.
+  bool InitializeEncoder();
   bool EncodeFrame(const std::string& img);
+  // Encode a frame the caller already holds in memory. The planes are
+  // referenced, not copied; release(opaque, data[0]) is called exactly once
+  // when the encoder is done with them, also when encoding fails. With no
+  // release the planes must stay valid until EncodeFrame() returns. With the
+  // drain thread the codec may still hold the frame then, so borrowed planes
+  // the converted frame still references (pass-through, shared luma) are copied.
+  // pts is in AV_TIME_BASE units, AV_NOPTS_VALUE numbers frames at the fps.
+  bool EncodeFrame(const uint8_t* const data[4], const int linesize[4], AVPixelFormat format,
+                   int frame_width, int frame_height, int64_t pts,
+                   void (*release)(void* opaque, uint8_t* data) = nullptr, void* opaque = nullptr);
+  // Wraps caller-owned planes in a refcounted AVFrame, same contract as above.
+  // Without release the planes are only borrowed, EncodePipeline::Submit()
+  // copies such a frame since it is converted after Submit() returns. Pass a
+  // release to hand the planes over without the copy.
+  //
+  // After the first frames, encoding an in-memory frame takes frame and
+  // packet structs and buffers from pools set up by Initialize(). What is
+  // left per frame are the small AVBufferRef handles FFmpeg allocates when a
+  // buffer is referenced (wrapping the planes, handing the frame to the codec,
+  // the packet payload). The image path also allocates the path string and
+  // the mapping of the file.
+  static AVFrame* WrapFrame(const uint8_t* const data[4], const int linesize[4],
+                            AVPixelFormat format, int frame_width, int frame_height, int64_t pts,
+                            void (*release)(void* opaque, uint8_t* data), void* opaque);
+  // Hint that img will be encoded soon so its file can be read ahead
+  void PrefetchFrame(const std::string& img);
+  // Drain the frames still buffered inside the encoder, done by Cleanup() otherwise
+  bool Flush();
+  // Horizontal bands a frame is converted in, 0 (default) uses one per core
+  void SetConvertBands(int bands);
+  // Pool the conversion bands run on, WorkerPool::Shared() by default
+  void SetWorkerPool(WorkerPool* pool);
+  // Codec threads, 0 (default) lets FFmpeg pick. Must be set before Initialize()
+  void SetCodecThreads(int threads);
+  // Drain packets and write them to the muxer on a thread of the encoder's
+  // own, so EncodeFrame() returns once the frame is in the codec and file
+  // I/O overlaps encoding. A write error then fails the next EncodeFrame()
+  // or Flush(). Must be set before Initialize(), not used by InitializeEncoder().
+  void SetDrainThread(bool enabled);
+  // Write a plain output file through AsyncFileWriter, so a slow eMMC/SD
+  // write does not hold up the muxer. On by default, must be set before
+  // Initialize(). URLs (with "://") always go through avio_open().
+  void SetBufferedOutput(bool enabled);
+  // Expected length of the recording, 0 (default) if unknown. Used to
+  // preallocate the output file from the bitrate.
+  void SetExpectedDuration(double seconds);
+  // Write fragmented MP4 (empty moov, a moof/mdat pair per fragment), so the
+  // file is playable while recording and nothing is rewritten at the end.
+  // A fragment is fragment_ms long and starts with a keyframe, the GOP is
+  // set to match the frame spacing when the codec opens. A SetFrameRate()
+  // change does not resize it until the codec is reopened, frag_duration
+  // still caps the fragments meanwhile. 0 (default) writes the classic
+  // layout with the moov at the end. Must be set before Initialize().
+  void SetFragmentedOutput(int fragment_ms);
+  // Write the H.264 elementary stream as Annex-B instead of a container, for
+  // consumers that packetize it themselves. No muxer is set up, packets go
+  // straight to the file with SPS/PPS in front of every keyframe. Must be
+  // set before Initialize().
+  void SetAnnexBOutput(bool enabled);
+  // Configure the codec for the lowest delay from a frame going in to its
+  // packet coming out, for live viewing: no B-frames, no lookahead, slice
+  // threads only, and libx264's zerolatency tune with periodic intra refresh
+  // instead of IDR frames, which also evens out the packet sizes. Frames
+  // slower than latency_budget_ms are counted in EncoderStats::late_frames.
+  // Must be set before Initialize().
+  void SetLiveMode(bool enabled, int latency_budget_ms = 50);
+  // Let SetBitrate() change the bitrate while encoding. libx264 only changes
+  // it in place under VBV, so it runs with a 1 s VBV at the bitrate then,
+  // which caps the peaks of the default average bitrate control. Must be
+  // set before Initialize(), libx264 only.
+  void EnableRuntimeBitrate(bool enabled);
+  // Runtime controls, safe to call from any thread while frames are encoded.
+  // Each takes effect with the next frame sent to the codec, no reopen.
+  //
+  // Target bitrate in bits/s, 2 Mbit/s by default. Before Initialize() it is
+  // the bitrate to start with. Once encoding, false unless
+  // EnableRuntimeBitrate() was set.
+  bool SetBitrate(int64_t bits_per_second);
+  // Encode the next frame as an IDR, e.g. for a viewer joining
+  void RequestKeyframe();
+  // Rate frames are numbered at from now on, for frames without a pts.
+  // libx264's rate control follows the timestamps. Only the spacing of the
+  // timestamps changes: the codec's framerate and the stream's
+  // avg_frame_rate keep the rate the encoder was constructed with.
+  void SetFrameRate(double fps);
+  // Tune libx264's preset and threads to encode at fps on this device, see
+  // EncoderTuner. Each change flushes the codec and reopens it, the stream
+  // goes on with a keyframe. SetCodecThreads() caps the threads it picks.
+  // 0 (default) keeps the fixed settings. Must be set before Initialize(),
+  // libx264 only.
+  void SetTargetFps(double fps);
+  // Size frames are encoded at, from the next frame converted on, e.g. to
+  // step down when the link or the device cannot keep up. At the first frame
+  // of the new size the codec is flushed and reopened, so it starts with an
+  // IDR and new SPS/PPS (and a new fragment). The output, muxer, scalers
+  // and frame pools stay, the converter keeps those of recent sizes. Safe to
+  // call from any thread, not for InitializeEncoder().
+  void SetResolution(int frame_width, int frame_height);
+  // Size of the raw BGR24 input files, the encoder's size by default. Safe
+  // to call from any thread, takes effect with the next file loaded.
+  void SetRawInputSize(int frame_width, int frame_height);
+  // Roll to a new output file every segment_s seconds or segment_bytes
+  // bytes, whichever comes first (0 for no limit), for recorders that run
+  // around the clock. A file starts at a keyframe, one is requested when a
+  // limit is reached, and a resolution change starts one too. The codec
+  // stays open across files and only the muxer is recreated, so no frame is
+  // lost at a boundary. Files are named after the Initialize() path with the
+  // segment number before the extension (rec.ts: rec_00000.ts, rec_00001.ts,
+  // ...), or that path is a printf pattern for it (rec_%03d.ts). With a
+  // playlist path an HLS playlist of the finished segments is kept in the
+  // same directory, MPEG-TS segments play in any HLS player. Must be set
+  // before Initialize().
+  void SetSegmentedOutput(double segment_s, int64_t segment_bytes,
+                          const std::string& playlist = "");
+  // Counters since construction, lock-free and safe to poll from any thread
+  EncoderStats GetStats() const { return stats_.Snapshot(); }
 
  private:
+  friend class EncodePipeline;
+  friend class ChunkedEncoder;
+
   EncoderType      encoder_type_;
   AVFormatContext* format_context_;
   AVCodecContext*  codec_context_;
@@ -36,19 +172,168 @@ class FFmpegEncoder {
 #ifdef SUPPORT_HW_ENCODER
   AVBufferRef*     hw_device_ctx;
 #endif
-  int64_t          next_pts;
-  int64_t          pts_increment;
+  FrameConverter   converter_;
+  WorkerPool*      worker_pool_;  // Conversion bands and pipeline decode batches, see Workers()
+  JpegDecoder      decoder_;  // Image decoder of the EncodeFrame() path
+  std::atomic<int64_t> next_pts;  // Taken by whichever stage numbers the frames
+  int64_t          pts_increment;  // Only touched by the stage numbering the frames
+  std::atomic<int64_t> bit_rate_;
+  std::atomic<bool>    bitrate_changed_;
+  std::atomic<bool>    keyframe_requested_;
+  std::atomic<int64_t> requested_increment_;  // From SetFrameRate(), 0 when none is pending
+  bool                 runtime_bitrate_;
+  std::atomic<bool>    codec_opened_;  // SetBitrate() is a runtime change from then on
+
+  // Where the frame rate changed, so FrameIndex() numbers any pts still in
+  // flight. Written by the numbering stage only, the count is published last.
+  struct RateChange {
+    std::atomic<int64_t> pts;
+    std::atomic<int64_t> index;
+    std::atomic<int64_t> increment;
+  };
+  static constexpr int kRateChanges = 8;
+  RateChange       rate_changes_[kRateChanges];
+  std::atomic<int> rate_change_count_;
   int              quality;
   int              fps;
-  int              width;
+  int              width;   // Of the open codec, only touched by the encode stage
   int              height;
+  std::atomic<int64_t> output_size_;     // SetResolution(), see PackSize()
+  std::atomic<int64_t> raw_input_size_;  // SetRawInputSize(), see PackSize()
+  std::atomic<int> convert_format_;   // What ConvertFrame() produces, set by SetupEncoder()
+  bool             codec_reopened_;  // ReceivePacket() tells the writer at the new codec's first packet
   bool             support_multiple_ref_frames_;
+  bool             header_written_;
+  bool             flushed_;
+  bool             closed_gop_;
+  int              codec_threads_;
+  EncoderCounters  stats_;
+  AVFramePool      frame_pool_;       // Every frame struct of the per-frame path
+  AVPacketPool     packet_pool_;      // Packets queued between pipeline stages
+  AVPacket*        packet_;           // Reused by DrainPackets()
+  AVBufferPool*    packet_buffers_;   // Encoded payloads, see GetEncodeBuffer()
+  int              packet_buffer_size_;
+  bool             pool_packets_;
+  bool             use_drain_thread_;
+  bool             buffered_output_;
+  double           expected_duration_s_;
+  int              fragment_ms_;
+  bool             annexb_output_;
+  AVIOContext*     annexb_file_;      // Annex-B mode's output, no format_context_ then
+  std::vector<uint8_t> parameter_sets_;  // SPS/PPS with start codes, put before keyframes
+  bool             live_mode_;
+  double           target_fps_;
+  std::unique_ptr<EncoderTuner> tuner_;  // Set by Initialize() when target_fps_ is
+  int64_t          last_dts_;         // Of the last muxed packet, in the stream's time base
+  std::unique_ptr<AsyncFileWriter> output_writer_;  // Set when it backs the output's AVIOContext
+  double           segment_s_;
+  int64_t          segment_bytes_;
+  std::string      playlist_path_;
+
+  // Segment state, only touched by the stage writing packets
+  struct Segment {
+    std::string name;
+    double      duration;
+  };
+  std::string      output_pattern_;     // Initialize() path the segments are named after
+  int              segment_index_;
+  int64_t          segment_start_pts_;  // First pts of the current segment, AV_TIME_BASE units
+  int64_t          segment_end_pts_;    // Past its last frame
+  int64_t          segment_size_;       // Bytes written to it
+  int64_t          segment_offset_;     // Taken off its timestamps, each file starts at 0
+  bool             segment_due_;        // A limit was reached, the next keyframe starts a file
+  bool             segment_failed_;     // The next file could not be opened
+  std::vector<Segment> segments_;       // Finished ones, for the playlist
+  AVCodecParameters* stream_params_;    // Of the stream in the current file
+
+  // Drain thread state. codec_mutex_ serializes the codec calls of the
+  // caller and the drain thread, the rest is guarded by it too.
+  std::thread             drain_thread_;
+  std::mutex              codec_mutex_;
+  std::condition_variable drain_cv_;    // Wakes the drain thread
+  std::condition_variable drained_cv_;  // Signalled after the drain thread received
+  bool                    drain_requested_;
+  bool                    drain_stop_;
+  bool                    drain_eof_;
+  std::atomic<bool>       drain_failed_;
 
   bool OpenVideoFile(const std::string& output_file);
-  bool SetupEncoder(const std::string& output_file);
+  bool SetupEncoder();
+  bool SetupOutput(const std::string& output_file);
+  bool SetupAnnexBOutput(const std::string& output_file);
+  bool OpenOutputFile(const std::string& output_file, AVIOContext** pb);
+  void CloseOutputFile(AVIOContext** pb);
+  // AVCodecContext.get_encode_buffer, hands out packet_buffers_
+  static int GetEncodeBuffer(AVCodecContext* context, AVPacket* pkt, int flags);
+  // Points frame at caller-owned planes, calls release on failure
+  static bool WrapPlanes(AVFrame* frame, const uint8_t* const data[4], const int linesize[4],
+                         AVPixelFormat format, int frame_width, int frame_height, int64_t pts,
+                         void (*release)(void* opaque, uint8_t* data), void* opaque);
+  // Pool set by SetWorkerPool(), WorkerPool::Shared() unless set
+  WorkerPool& Workers() const;
+  // The frame itself, or a pooled copy if any of its planes are borrowed
+  // (wrapped without release), also through a conversion that kept them.
+  // Takes ownership of the frame, nullptr on failure.
+  AVFrame* OwnedFrame(AVFrame* frame);
 #ifdef SUPPORT_HW_ENCODER
   bool InitializeHWContext();
 #endif
+  // Encode stages, EncodeFrame() runs them back-to-back and
+  // EncodePipeline runs each of them on its own thread
+  AVFrame* LoadFrame(const std::string& img);
+  // Same with a caller-provided decoder, so several images can load at once
+  AVFrame* LoadFrame(const std::string& img, JpegDecoder& decoder);
+  // Convert, send and drain one source frame, takes ownership of it.
+  // submit_us is when the caller handed it in, for the latency stats.
+  bool EncodeSourceFrame(AVFrame* frame, int64_t submit_us);
+  AVFrame* ConvertFrame(const AVFrame* imgFrame);
+  bool SendFrame(AVFrame* sw_frame);
+  int  ReceivePacket(AVPacket* pkt);
+  bool WritePacket(AVPacket* pkt);
+  bool WriteAnnexBPacket(AVPacket* pkt);
+  bool Segmented() const { return segment_s_ > 0 || segment_bytes_ > 0; }
+  std::string SegmentPath(int index) const;
+  // Rolls to the next file when pkt is due to start it, false if that failed
+  bool CheckSegment(const AVPacket* pkt);
+  // Finishes the current file and starts the next one with pkt, a keyframe.
+  // new_width/new_height are the stream's size from then on, 0 if unchanged.
+  bool RollSegment(const AVPacket* pkt, int new_width, int new_height);
+  // Closes the current file and adds it to the playlist, which is rewritten
+  void FinishSegment(int64_t end_pts, bool last);
+  bool WritePlaylist(bool ended);
+  bool DrainPackets();
+  // avcodec_send_frame(), through the drain thread's lock when it runs.
+  // Applies the pending runtime controls first.
+  int  SendToCodec(AVFrame* frame);
+  bool DrainsAsync() const { return drain_thread_.joinable(); }
+  void DrainLoop();
+  // Waits until the drain thread has written the end of the stream
+  bool WaitForDrain();
+  void StopDrainThread();
+  // Pending SetBitrate()/RequestKeyframe(), with the codec lock held
+  void ApplyControls(AVFrame* frame);
+  // Gives the frame the next pts unless it already has one
+  void AssignPts(AVFrame* frame);
+  // Starts the frame's latency sample. Its sequence number rides in
+  // frame->opaque, which the codec copies to the packet.
+  void NumberFrame(AVFrame* frame, int64_t submit_us);
+  // Ends the latency sample of the frame a packet came from
+  void PacketEncoded(const AVPacket* pkt);
+  // Encode time of a frame for the tuner, true when the codec has to be
+  // reopened with new settings
+  bool RetuneDue(int64_t encode_us) { return tuner_ && tuner_->AddFrame(encode_us); }
+  // Whether the codec has to be reopened at the converted frame's size first
+  bool SizeChanged(const AVFrame* sw_frame) const {
+    return sw_frame->width != width || sw_frame->height != height;
+  }
+  // Replaces the drained codec with one opened with the tuner's settings,
+  // at a new size if one is given
+  bool ReopenCodec(int frame_width = 0, int frame_height = 0);
+  // Frame number for a pts, used to tag trace spans
+  int64_t FrameIndex(int64_t pts) const;
+  // Spacing of the frames around a pts, in AV_TIME_BASE units
+  int64_t FrameDuration(int64_t pts) const;
+
   bool WriteTrailer();
   void Cleanup();
 };
@@ -0,0 +1,387 @@
+#include "frame_converter.h"
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/macros.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include <algorithm>
+#include <atomic>
+
+#include "my_log.h"
+#include "nv12_convert.h"
+#include "worker_pool.h"
+
+// Line and buffer alignment of pooled frames, enough for the widest SIMD path
+constexpr int kFrameAlign = 64;
+// Automatic band count stops here, past 8 cores conversion is memory bound
+constexpr int kMaxAutoBands = 8;
+// Bands thinner than this cost more in dispatch than they save
+constexpr int kMinBandRows = 32;
+// Scalers and pools kept each, the least recently used one goes beyond
+constexpr size_t kMaxCached = 6;
+
+static void FreeContexts(std::vector<SwsContext *> &contexts) {
+    for (SwsContext *context : contexts) {
+        sws_freeContext(context);
+    }
+    contexts.clear();
+}
+
+bool FrameConverter::ScalerKey::operator==(const ScalerKey &other) const {
+    return src_format == other.src_format && src_width == other.src_width &&
+           src_height == other.src_height && dst_format == other.dst_format &&
+           dst_width == other.dst_width && dst_height == other.dst_height &&
+           flags == other.flags && bands == other.bands;
+}
+
+FrameConverter::FrameConverter() : use_count_(0), pool_(nullptr), frames_(nullptr), bands_(0) {
+    ILOGD("FrameConverter - BGR24 -> NV12 kernel: %s", Bgr24ToNv12KernelName());
+}
+
+FrameConverter::~FrameConverter() {
+    Reset();
+}
+
+void FrameConverter::Reset() {
+    for (auto &scaler : scalers_) {
+        FreeContexts(scaler.contexts);
+    }
+    scalers_.clear();
+
+    // Buffers still referenced by frames in flight are freed when they come back
+    for (auto &pool : pools_) {
+        av_buffer_pool_uninit(&pool.pool);
+    }
+    pools_.clear();
+}
+
+void FrameConverter::SetBands(int bands) {
+    bands_ = std::max(bands, 0);
+}
+
+void FrameConverter::SetWorkerPool(WorkerPool *pool) {
+    pool_ = pool;
+}
+
+void FrameConverter::SetFramePool(AVFramePool *frames) {
+    frames_ = frames;
+}
+
+AVFrame *FrameConverter::NewFrame() {
+    return frames_ ? frames_->Get() : av_frame_alloc();
+}
+
+void FrameConverter::FreeFrame(AVFrame *&frame) {
+    if (frames_) {
+        frames_->Put(frame);
+    } else {
+        av_frame_free(&frame);
+    }
+}
+
+int FrameConverter::BandCount(int height) const {
+    int bands = bands_;
+    if (bands == 0) {
+        WorkerPool &pool = pool_ ? *pool_ : WorkerPool::Shared();
+        bands = std::min(pool.Concurrency(), kMaxAutoBands);
+    }
+    return std::max(1, std::min(bands, height / kMinBandRows));
+}
+
+FrameConverter::Scaler *FrameConverter::GetScaler(const ScalerKey &key) {
+    for (auto &scaler : scalers_) {
+        if (scaler.key == key) {
+            scaler.last_used = ++use_count_;
+            return &scaler;
+        }
+    }
+    if (scalers_.size() >= kMaxCached) {
+        auto oldest = std::min_element(scalers_.begin(), scalers_.end(),
+                                       [](const Scaler &a, const Scaler &b) {
+                                           return a.last_used < b.last_used;
+                                       });
+        FreeContexts(oldest->contexts);
+        scalers_.erase(oldest);
+    }
+
+    ILOGD("FrameConverter::GetScaler - new scaler %s %dx%d -> %s %dx%d, flags=%d, bands=%d",
+          av_get_pix_fmt_name(key.src_format), key.src_width, key.src_height,
+          av_get_pix_fmt_name(key.dst_format), key.dst_width, key.dst_height, key.flags,
+          key.bands);
+    Scaler scaler = {key, {}, true, ++use_count_};
+    for (int band = 0; band < key.bands; ++band) {
+        // Built through AVOptions because sws_getContext() has no thread count.
+        // The bands are the parallelism, swscale must not start threads of its own.
+        SwsContext *context = sws_alloc_context();
+        if (!context) {
+            ILOGE("Could not allocate the conversion context");
+            FreeContexts(scaler.contexts);
+            return nullptr;
+        }
+        scaler.contexts.push_back(context);
+        av_opt_set_int(context, "srcw", key.src_width, 0);
+        av_opt_set_int(context, "srch", key.src_height, 0);
+        av_opt_set_int(context, "src_format", key.src_format, 0);
+        av_opt_set_int(context, "dstw", key.dst_width, 0);
+        av_opt_set_int(context, "dsth", key.dst_height, 0);
+        av_opt_set_int(context, "dst_format", key.dst_format, 0);
+        av_opt_set_int(context, "sws_flags", key.flags, 0);
+        av_opt_set_int(context, "threads", 1, 0);
+        if (sws_init_context(context, nullptr, nullptr) < 0) {
+            ILOGE("Could not initialize the conversion context");
+            FreeContexts(scaler.contexts);
+            return nullptr;
+        }
+    }
+    scalers_.push_back(std::move(scaler));
+    return &scalers_.back();
+}
+
+bool FrameConverter::Scale(Scaler *scaler, const AVFrame *src, AVFrame *dst) {
+    int bands = static_cast<int>(scaler->contexts.size());
+    if (bands > 1 && scaler->sliced) {
+        // Every band context reads the whole source and writes only its own output rows
+        int align = std::max(static_cast<int>(sws_receive_slice_alignment(scaler->contexts[0])), 2);
+        int band_rows = FFALIGN((dst->height + bands - 1) / bands, align);
+        std::atomic<bool> failed(false);
+        auto scale_band = [scaler, src, dst, band_rows, &failed](int band) {
+            int y = band * band_rows;
+            int rows = std::min(band_rows, dst->height - y);
+            if (rows <= 0) {
+                return;
+            }
+            SwsContext *context = scaler->contexts[band];
+            int ret = sws_frame_start(context, dst, src);
+            if (ret >= 0) {
+                ret = sws_send_slice(context, 0, src->height);
+            }
+            if (ret >= 0) {
+                ret = sws_receive_slice(context, y, rows);
+            }
+            sws_frame_end(context);
+            if (ret < 0) {
+                failed = true;
+            }
+        };
+        WorkerPool &pool = pool_ ? *pool_ : WorkerPool::Shared();
+        pool.ParallelFor(bands, scale_band);
+        if (!failed) {
+            return true;
+        }
+        // swscale's unscaled special converters only produce whole frames
+        ILOGW("FrameConverter::Scale - %s -> %s cannot be sliced, converting whole frames",
+              av_get_pix_fmt_name(scaler->key.src_format),
+              av_get_pix_fmt_name(scaler->key.dst_format));
+        scaler->sliced = false;
+    }
+    return sws_scale_frame(scaler->contexts[0], dst, src) >= 0;
+}
+
+FrameConverter::FramePool *FrameConverter::GetPool(AVPixelFormat format, int width, int height) {
+    for (auto &pool : pools_) {
+        if (pool.format == format && pool.width == width && pool.height == height) {
+            pool.last_used = ++use_count_;
+            return &pool;
+        }
+    }
+    if (pools_.size() >= kMaxCached) {
+        auto oldest = std::min_element(pools_.begin(), pools_.end(),
+                                       [](const FramePool &a, const FramePool &b) {
+                                           return a.last_used < b.last_used;
+                                       });
+        // Its buffers still in flight are freed when they come back
+        av_buffer_pool_uninit(&oldest->pool);
+        pools_.erase(oldest);
+    }
+
+    FramePool pool = {};
+    pool.format = format;
+    pool.width = width;
+    pool.height = height;
+    pool.last_used = ++use_count_;
+    if (av_image_fill_linesizes(pool.linesize, format, FFALIGN(width, kFrameAlign)) < 0) {
+        ILOGE("FrameConverter::GetPool - unsupported format %s", av_get_pix_fmt_name(format));
+        return nullptr;
+    }
+
+    ptrdiff_t linesizes[4];
+    size_t plane_sizes[4];
+    for (int i = 0; i < 4; ++i) {
+        linesizes[i] = pool.linesize[i];
+    }
+    if (av_image_fill_plane_sizes(plane_sizes, format, height, linesizes) < 0) {
+        ILOGE("FrameConverter::GetPool - could not compute plane sizes for %dx%d", width, height);
+        return nullptr;
+    }
+    size_t total = 0;
+    for (int i = 0; i < 4; ++i) {
+        total += plane_sizes[i];
+    }
+
+    pool.pool = av_buffer_pool_init(total + kFrameAlign, av_buffer_alloc);
+    if (!pool.pool) {
+        ILOGE("FrameConverter::GetPool - could not create buffer pool");
+        return nullptr;
+    }
+    ILOGD("FrameConverter::GetPool - new pool %s %dx%d, %zu bytes per frame",
+          av_get_pix_fmt_name(format), width, height, total);
+    pools_.push_back(pool);
+    return &pools_.back();
+}
+
+AVFrame *FrameConverter::GetFrame(AVPixelFormat format, int width, int height) {
+    FramePool *pool = GetPool(format, width, height);
+    if (!pool) {
+        return nullptr;
+    }
+
+    AVFrame *frame = NewFrame();
+    if (!frame) {
+        ILOGE("Could not allocate frame");
+        return nullptr;
+    }
+    frame->buf[0] = av_buffer_pool_get(pool->pool);
+    if (!frame->buf[0]) {
+        ILOGE("Could not get a buffer from the frame pool");
+        FreeFrame(frame);
+        return nullptr;
+    }
+
+    uint8_t *data = reinterpret_cast<uint8_t *>(FFALIGN(reinterpret_cast<uintptr_t>(frame->buf[0]->data),
+                                                         kFrameAlign));
+    av_image_fill_pointers(frame->data, format, height, data, pool->linesize);
+    for (int i = 0; i < 4; ++i) {
+        frame->linesize[i] = pool->linesize[i];
+    }
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    return frame;
+}
+
+void FrameConverter::ConvertBgr24ToNv12(const AVFrame *src, AVFrame *dst) {
+    int bands = BandCount(dst->height);
+    // Even band height keeps each chroma row inside a single band
+    int band_rows = FFALIGN((dst->height + bands - 1) / bands, 2);
+    auto convert_band = [src, dst, band_rows](int band) {
+        int y = band * band_rows;
+        int rows = std::min(band_rows, dst->height - y);
+        if (rows <= 0) {
+            return;
+        }
+        Bgr24ToNv12(src->data[0] + y * src->linesize[0], src->linesize[0],
+                    dst->data[0] + y * dst->linesize[0], dst->linesize[0],
+                    dst->data[1] + (y / 2) * dst->linesize[1], dst->linesize[1],
+                    dst->width, rows);
+    };
+
+    if (bands == 1) {
+        convert_band(0);
+        return;
+    }
+    WorkerPool &pool = pool_ ? *pool_ : WorkerPool::Shared();
+    pool.ParallelFor(bands, convert_band);
+}
+
+AVFrame *FrameConverter::ConvertNv21ToNv12(const AVFrame *src) {
+    AVBufferRef *luma = av_frame_get_plane_buffer(const_cast<AVFrame *>(src), 0);
+    if (!luma) {
+        ILOGE("FrameConverter::ConvertNv21ToNv12 - source frame is not refcounted");
+        return nullptr;
+    }
+    AVFrame *dst = GetFrame(AV_PIX_FMT_NV12, src->width, src->height);
+    if (!dst) {
+        return nullptr;
+    }
+    // Luma is shared with the source, only the chroma plane of dst is written
+    dst->buf[1] = av_buffer_ref(luma);
+    if (!dst->buf[1]) {
+        ILOGE("Could not reference the source luma plane");
+        FreeFrame(dst);
+        return nullptr;
+    }
+    dst->data[0] = src->data[0];
+    dst->linesize[0] = src->linesize[0];
+    Nv21ToNv12Chroma(src->data[1], src->linesize[1], dst->data[1], dst->linesize[1],
+                     src->width, (src->height + 1) / 2);
+    return dst;
+}
+
+AVFrame *FrameConverter::ConvertYuv420pToNv12(const AVFrame *src) {
+    bool full_range = src->format == AV_PIX_FMT_YUVJ420P || src->color_range == AVCOL_RANGE_JPEG;
+    AVBufferRef *luma = full_range ? nullptr
+                                   : av_frame_get_plane_buffer(const_cast<AVFrame *>(src), 0);
+    AVFrame *dst = GetFrame(AV_PIX_FMT_NV12, src->width, src->height);
+    if (!dst) {
+        return nullptr;
+    }
+    if (luma) {
+        // Limited range luma is already final, share it like the NV21 path does
+        dst->buf[1] = av_buffer_ref(luma);
+        if (!dst->buf[1]) {
+            ILOGE("Could not reference the source luma plane");
+            FreeFrame(dst);
+            return nullptr;
+        }
+        dst->data[0] = src->data[0];
+        dst->linesize[0] = src->linesize[0];
+    }
+    Yuv420pToNv12(src->data[0], src->linesize[0], src->data[1], src->linesize[1],
+                  src->data[2], src->linesize[2], luma ? nullptr : dst->data[0], dst->linesize[0],
+                  dst->data[1], dst->linesize[1], src->width, src->height, full_range);
+    dst->color_range = AVCOL_RANGE_MPEG;
+    return dst;
+}
+
+AVFrame *FrameConverter::Convert(const AVFrame *src, AVPixelFormat dst_format, int dst_width,
+                                 int dst_height, int flags) {
+    bool same_size = src->width == dst_width && src->height == dst_height;
+    if (same_size && src->format == dst_format) {
+        // Already what the encoder takes, pass it through without touching pixels
+        AVFrame *dst = NewFrame();
+        if (!dst || av_frame_ref(dst, src) < 0) {
+            ILOGE("Could not reference the source frame");
+            FreeFrame(dst);
+        }
+        return dst;
+    }
+    if (same_size && src->format == AV_PIX_FMT_NV21 && dst_format == AV_PIX_FMT_NV12) {
+        return ConvertNv21ToNv12(src);
+    }
+    if (same_size && (src->format == AV_PIX_FMT_YUV420P || src->format == AV_PIX_FMT_YUVJ420P) &&
+        dst_format == AV_PIX_FMT_NV12) {
+        return ConvertYuv420pToNv12(src);
+    }
+
+    // Same-size BGR24 -> NV12 is the common case, it skips swscale entirely
+    if (same_size && src->format == AV_PIX_FMT_BGR24 && dst_format == AV_PIX_FMT_NV12) {
+        AVFrame *dst = GetFrame(dst_format, dst_width, dst_height);
+        if (!dst) {
+            return nullptr;
+        }
+        ConvertBgr24ToNv12(src, dst);
+        return dst;
+    }
+
+    ScalerKey key = {static_cast<AVPixelFormat>(src->format), src->width, src->height,
+                     dst_format, dst_width, dst_height, flags, BandCount(dst_height)};
+    Scaler *scaler = GetScaler(key);
+    if (!scaler) {
+        return nullptr;
+    }
+
+    AVFrame *dst = GetFrame(dst_format, dst_width, dst_height);
+    if (!dst) {
+        return nullptr;
+    }
+
+    if (!Scale(scaler, src, dst)) {
+        ILOGE("FrameConverter::Convert - swscale conversion failed");
+        FreeFrame(dst);
+        return nullptr;
+    }
+    return dst;
+}
@@ -0,0 +1,106 @@
+#ifndef FRAME_CONVERTER_H
+#define FRAME_CONVERTER_H
+
+extern "C" {
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+#include <libswscale/swscale.h>
+}
+
+#include <vector>
+
+#include "av_object_pool.h"
+
+class WorkerPool;
+
+// Colour conversion engine owned by FFmpegEncoder.
+//
+// Keeps one SwsContext per (src fmt, src size, dst fmt, dst size, flags) so
+// the scaler tables are built once, and hands out destination frames backed
+// by an AVBufferPool so the pixel buffers are recycled instead of allocated
+// per frame. Only the most recently used scalers and pools are kept, enough
+// for a stream switching between a few resolutions. Not thread-safe, it is
+// driven from a single convert stage.
+//
+// A frame is converted in horizontal bands that run in parallel on a
+// WorkerPool. Bands start on even rows so every 4:2:0 chroma row belongs to
+// exactly one band. The swscale path gives each band its own single-threaded
+// SwsContext, so no scaler brings threads of its own next to the pool.
+class FrameConverter {
+ public:
+  FrameConverter();
+  ~FrameConverter();
+
+  FrameConverter(const FrameConverter&) = delete;
+  FrameConverter& operator=(const FrameConverter&) = delete;
+
+  // Returns a new frame in dst_format/dst_width x dst_height, or nullptr on failure.
+  // Input already in dst_format and size comes back as a new reference to the
+  // same buffers, NV21 -> NV12 keeps the luma plane and only swaps chroma.
+  // Planar 4:2:0 (e.g. decoded JPEG) -> NV12 only interleaves chroma, plus a
+  // range mapping for full-range input.
+  AVFrame* Convert(const AVFrame* src, AVPixelFormat dst_format, int dst_width, int dst_height,
+                   int flags);
+  // Frame whose buffer comes from the pool for the given format and size
+  AVFrame* GetFrame(AVPixelFormat format, int width, int height);
+  // Drop all cached scalers and pools, outstanding frames stay valid
+  void Reset();
+
+  // Number of bands a frame is split into, 0 picks one per pool thread
+  void SetBands(int bands);
+  // Pool the bands run on, WorkerPool::Shared() unless set
+  void SetWorkerPool(WorkerPool* pool);
+  // Where output frame structs come from, av_frame_alloc() unless set
+  void SetFramePool(AVFramePool* frames);
+
+ private:
+  struct ScalerKey {
+    AVPixelFormat src_format;
+    int           src_width;
+    int           src_height;
+    AVPixelFormat dst_format;
+    int           dst_width;
+    int           dst_height;
+    int           flags;
+    int           bands;
+
+    bool operator==(const ScalerKey& other) const;
+  };
+
+  struct Scaler {
+    ScalerKey                key;
+    std::vector<SwsContext*> contexts;  // One per band
+    bool                     sliced;    // False once swscale refused a partial output slice
+    uint64_t                 last_used;
+  };
+
+  struct FramePool {
+    AVPixelFormat  format;
+    int            width;
+    int            height;
+    int            linesize[4];
+    AVBufferPool*  pool;
+    uint64_t       last_used;
+  };
+
+  Scaler*     GetScaler(const ScalerKey& key);
+  bool        Scale(Scaler* scaler, const AVFrame* src, AVFrame* dst);
+  FramePool*  GetPool(AVPixelFormat format, int width, int height);
+  // Bands worth using for a frame of the given height
+  int         BandCount(int height) const;
+  void        ConvertBgr24ToNv12(const AVFrame* src, AVFrame* dst);
+  AVFrame*    ConvertNv21ToNv12(const AVFrame* src);
+  AVFrame*    ConvertYuv420pToNv12(const AVFrame* src);
+  AVFrame*    NewFrame();
+  void        FreeFrame(AVFrame*& frame);
+
+  std::vector<Scaler>    scalers_;
+  std::vector<FramePool> pools_;
+  uint64_t               use_count_;  // Ticks on every lookup, for last_used
+  WorkerPool*            pool_;
+  AVFramePool*           frames_;
+  int                    bands_;
+};
+
+#endif /* FRAME_CONVERTER_H */
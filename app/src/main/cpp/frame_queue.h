@@ -0,0 +1,85 @@
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Bounded blocking FIFO used to connect the encode pipeline stages.
+// Push() blocks while the queue is full (backpressure), Pop() blocks while
+// it is empty. After Close() pushes fail and Pop() drains what is left.
+// Storage is a fixed ring, so steady-state Push/Pop never allocate.
+template <typename T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity)
+      : capacity_(capacity ? capacity : 1), head_(0), count_(0), closed_(false), items_(capacity_) {}
+
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  bool Push(T item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] { return closed_ || count_ < capacity_; });
+    if (closed_) return false;
+    items_[(head_ + count_) % capacity_] = std::move(item);
+    ++count_;
+    lock.unlock();
+    not_empty_.notify_one();
+    return true;
+  }
+
+  bool Pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return closed_ || count_ > 0; });
+    if (count_ == 0) return false;
+    item = std::move(items_[head_]);
+    head_ = (head_ + 1) % capacity_;
+    --count_;
+    lock.unlock();
+    not_full_.notify_one();
+    return true;
+  }
+
+  // Non-blocking Pop(), false if nothing is queued right now
+  bool TryPop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (count_ == 0) return false;
+    item = std::move(items_[head_]);
+    head_ = (head_ + 1) % capacity_;
+    --count_;
+    lock.unlock();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    not_full_.notify_all();
+    not_empty_.notify_all();
+  }
+
+  size_t Size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return count_;
+  }
+
+  size_t Capacity() const { return capacity_; }
+
+ private:
+  const size_t            capacity_;
+  size_t                  head_;
+  size_t                  count_;
+  bool                    closed_;
+  std::vector<T>          items_;
+  mutable std::mutex      mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+};
+
+#endif /* FRAME_QUEUE_H */
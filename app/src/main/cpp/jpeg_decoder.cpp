@@ -0,0 +1,134 @@
+#include "jpeg_decoder.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "my_log.h"
+#include "trace.h"
+
+// Headroom when the file buffer grows, so slightly larger images reuse it
+constexpr size_t kFileBufferSlack = 64 * 1024;
+
+JpegDecoder::JpegDecoder() : context_(nullptr), packet_(nullptr), file_buffer_(nullptr) {
+}
+
+JpegDecoder::~JpegDecoder() {
+    av_packet_free(&packet_);
+    av_buffer_unref(&file_buffer_);
+    avcodec_free_context(&context_);
+}
+
+bool JpegDecoder::Open() {
+    const AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_MJPEG);
+    if (!codec) {
+        ILOGE("MJPEG decoder not found");
+        return false;
+    }
+    context_ = avcodec_alloc_context3(codec);
+    packet_ = av_packet_alloc();
+    if (!context_ || !packet_) {
+        ILOGE("Could not allocate image decoder");
+        return false;
+    }
+    // Images are decoded in parallel one per decoder, not sliced inside one
+    context_->thread_count = 1;
+    if (avcodec_open2(context_, codec, nullptr) < 0) {
+        ILOGE("Could not open image codec");
+        avcodec_free_context(&context_);
+        return false;
+    }
+    return true;
+}
+
+bool JpegDecoder::ReadFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ILOGE("Could not open the image file: %s", path.c_str());
+        return false;
+    }
+    struct stat st = {};
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        ILOGE("Image file %s is empty", path.c_str());
+        close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+
+    // The bitstream reader may read past the end, the padding must be zero
+    size_t needed = size + AV_INPUT_BUFFER_PADDING_SIZE;
+    if (!file_buffer_ || file_buffer_->size < needed || !av_buffer_is_writable(file_buffer_)) {
+        av_buffer_unref(&file_buffer_);
+        file_buffer_ = av_buffer_alloc(needed + kFileBufferSlack);
+        if (!file_buffer_) {
+            ILOGE("Could not allocate %zu bytes for image file: %s", size, path.c_str());
+            close(fd);
+            return false;
+        }
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, file_buffer_->data + done, size - done);
+        if (n <= 0) {
+            break;
+        }
+        done += static_cast<size_t>(n);
+    }
+    close(fd);
+    if (done != size) {
+        ILOGE("Error reading the image file: %s", path.c_str());
+        return false;
+    }
+    memset(file_buffer_->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+    packet_->buf = av_buffer_ref(file_buffer_);
+    if (!packet_->buf) {
+        ILOGE("Could not reference the image file buffer");
+        return false;
+    }
+    packet_->data = file_buffer_->data;
+    packet_->size = static_cast<int>(size);
+    return true;
+}
+
+AVFrame *JpegDecoder::Decode(const std::string &path) {
+    AVFrame *frame = av_frame_alloc();
+    if (!frame) {
+        ILOGE("Could not allocate image frame");
+        return nullptr;
+    }
+    if (!Decode(path, frame)) {
+        av_frame_free(&frame);
+        return nullptr;
+    }
+    return frame;
+}
+
+bool JpegDecoder::Decode(const std::string &path, AVFrame *frame) {
+    TRACE_SPAN("decode");
+    if (!context_ && !Open()) {
+        return false;
+    }
+    if (!ReadFile(path)) {
+        return false;
+    }
+
+    int ret = avcodec_send_packet(context_, packet_);
+    av_packet_unref(packet_);
+    if (ret < 0) {
+        ILOGE("Error sending a packet for decoding: %s", path.c_str());
+        avcodec_flush_buffers(context_);
+        return false;
+    }
+
+    // MJPEG has no frame delay, the picture is out as soon as its packet is in
+    if (avcodec_receive_frame(context_, frame) < 0) {
+        ILOGE("Error during decoding: %s", path.c_str());
+        avcodec_flush_buffers(context_);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,39 @@
+#ifndef JPEG_DECODER_H
+#define JPEG_DECODER_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+}
+
+#include <string>
+
+// Decodes JPEG files with an MJPEG decoder that is opened once and reused,
+// so an image costs a file read and a decode instead of a format probe plus
+// a codec open. The file buffer is reused from image to image, so decoding
+// does no allocation of its own past the first few images, except for the
+// frame returned by Decode(path). One instance per thread, it is not
+// thread-safe.
+class JpegDecoder {
+ public:
+  JpegDecoder();
+  ~JpegDecoder();
+
+  JpegDecoder(const JpegDecoder&) = delete;
+  JpegDecoder& operator=(const JpegDecoder&) = delete;
+
+  // Returns the decoded image, or nullptr on failure
+  AVFrame* Decode(const std::string& path);
+  // Decodes into an empty frame the caller owns, e.g. one from an AVFramePool
+  bool Decode(const std::string& path, AVFrame* frame);
+
+ private:
+  bool Open();
+  bool ReadFile(const std::string& path);
+
+  AVCodecContext* context_;
+  AVPacket*       packet_;
+  AVBufferRef*    file_buffer_;  // Last image read, reused once the codec lets go of it
+};
+
+#endif /* JPEG_DECODER_H */
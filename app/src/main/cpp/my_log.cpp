@@ -0,0 +1,216 @@
+#include "my_log.h"
+
+extern "C" {
+#include <libavutil/log.h>
+}
+
+#ifdef ANDROID
+#include <android/log.h>
+#else
+#include <sys/time.h>
+#include <cstdio>
+#include <ctime>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+constexpr size_t kLogSlots = 512;     // Power of two
+constexpr size_t kLogLineSize = 256;  // Longer lines are cut
+constexpr auto   kLogIdle = std::chrono::milliseconds(20);
+// FFmpeg lines allowed per second, the rest are counted and reported
+constexpr int64_t kFFmpegLinesPerSecond = 50;
+
+int64_t WallTimeUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Bounded multi-producer ring after Vyukov: a slot's sequence tells whether
+// it is free for position pos (seq == pos) or holds the line of pos
+// (seq == pos + 1). Producers claim a position with one CAS and format in
+// place, the single drain thread hands slots back kLogSlots positions on.
+class AsyncLog {
+ public:
+  static AsyncLog& Instance() {
+      // Never destroyed, lines may still be logged from other threads at exit
+      static AsyncLog* log = new AsyncLog();
+      return *log;
+  }
+
+  void Write(int level, const char* tag, const char* fmt, va_list vl) {
+      size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+      Slot* slot;
+      while (true) {
+          slot = &slots_[pos & (kLogSlots - 1)];
+          size_t seq = slot->seq.load(std::memory_order_acquire);
+          intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+          if (diff == 0) {
+              if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                  break;
+              }
+          } else if (diff < 0) {
+              dropped_.fetch_add(1, std::memory_order_relaxed);
+              return;
+          } else {
+              pos = enqueue_pos_.load(std::memory_order_relaxed);
+          }
+      }
+      slot->level = level;
+      slot->tag = tag;
+      slot->time_us = WallTimeUs();
+      vsnprintf(slot->text, kLogLineSize, fmt, vl);
+      slot->seq.store(pos + 1, std::memory_order_release);
+  }
+
+  void Flush() {
+      size_t target = enqueue_pos_.load(std::memory_order_acquire);
+      std::unique_lock<std::mutex> lock(mutex_);
+      flush_requested_ = true;
+      wake_cv_.notify_one();
+      // Bounded, a producer that claimed a slot and stalled must not hang exit
+      flushed_cv_.wait_for(lock, std::chrono::seconds(1), [this, target] {
+          return dequeue_pos_.load(std::memory_order_acquire) >= target;
+      });
+  }
+
+ private:
+  struct Slot {
+    std::atomic<size_t> seq;
+    int                 level;
+    const char*         tag;
+    int64_t             time_us;
+    char                text[kLogLineSize];
+  };
+
+  AsyncLog() : enqueue_pos_(0), dequeue_pos_(0), dropped_(0), flush_requested_(false) {
+      for (size_t i = 0; i < kLogSlots; ++i) {
+          slots_[i].seq.store(i, std::memory_order_relaxed);
+      }
+      std::thread(&AsyncLog::DrainLoop, this).detach();
+      std::atexit([] { AsyncLog::Instance().Flush(); });
+  }
+
+  void DrainLoop() {
+      while (true) {
+          size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+          Slot& slot = slots_[pos & (kLogSlots - 1)];
+          if (slot.seq.load(std::memory_order_acquire) == pos + 1) {
+              Print(slot.level, slot.tag, slot.time_us, slot.text);
+              slot.seq.store(pos + kLogSlots, std::memory_order_release);
+              dequeue_pos_.store(pos + 1, std::memory_order_release);
+              continue;
+          }
+
+          int64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+          if (dropped > 0) {
+              char text[64];
+              snprintf(text, sizeof(text), "%lld log lines dropped, the ring was full",
+                       static_cast<long long>(dropped));
+              Print(LOG_LEVEL_WARN, LOG_TAG, WallTimeUs(), text);
+          }
+
+          std::unique_lock<std::mutex> lock(mutex_);
+          // Caught up, let Flush() check whether its lines are out
+          flush_requested_ = false;
+          flushed_cv_.notify_all();
+          // Producers never signal, lines wait at most kLogIdle
+          wake_cv_.wait_for(lock, kLogIdle, [this] { return flush_requested_; });
+      }
+  }
+
+  static void Print(int level, const char* tag, int64_t time_us, const char* text) {
+#ifdef ANDROID
+      static const int kPriorities[] = {ANDROID_LOG_DEBUG, ANDROID_LOG_INFO, ANDROID_LOG_WARN,
+                                        ANDROID_LOG_ERROR};
+      (void)time_us;
+      __android_log_write(kPriorities[level], tag, text);
+#else
+      // "HH:MM:SS.mmm" prefix, stderr so tools can keep stdout for their own output
+      time_t seconds = static_cast<time_t>(time_us / 1000000);
+      struct tm tm;
+      localtime_r(&seconds, &tm);
+      (void)level;
+      (void)tag;
+      fprintf(stderr, " %02d:%02d:%02d.%03d %s\n", tm.tm_hour, tm.tm_min, tm.tm_sec,
+              static_cast<int>(time_us / 1000 % 1000), text);
+#endif
+  }
+
+  Slot                    slots_[kLogSlots];
+  std::atomic<size_t>     enqueue_pos_;
+  std::atomic<size_t>     dequeue_pos_;  // Only advanced by the drain thread
+  std::atomic<int64_t>    dropped_;
+  std::mutex              mutex_;
+  std::condition_variable wake_cv_;
+  std::condition_variable flushed_cv_;
+  bool                    flush_requested_;  // Guarded by mutex_
+};
+
+int FromAVLevel(int level) {
+    if (level <= AV_LOG_ERROR) {
+        return LOG_LEVEL_ERROR;
+    }
+    if (level <= AV_LOG_WARNING) {
+        return LOG_LEVEL_WARN;
+    }
+    return level <= AV_LOG_INFO ? LOG_LEVEL_INFO : LOG_LEVEL_DEBUG;
+}
+
+std::atomic<int64_t> ff_window_s(0);
+std::atomic<int64_t> ff_lines(0);
+std::atomic<int64_t> ff_suppressed(0);
+
+}  // namespace
+
+void LogWrite(int level, const char *tag, const char *fmt, ...) {
+    va_list vl;
+    va_start(vl, fmt);
+    AsyncLog::Instance().Write(level, tag, fmt, vl);
+    va_end(vl);
+}
+
+void LogFlush() {
+    AsyncLog::Instance().Flush();
+}
+
+void LogFFmpegCallback(void *avcl, int level, const char *fmt, va_list vl) {
+    // Unlike the default callback, av_log() hands every line to a custom one
+    int log_level = FromAVLevel(level);
+    if (level > av_log_get_level() || log_level < LOG_MIN_LEVEL) {
+        return;
+    }
+
+    // Fixed one second windows, the first line of a new window reports the
+    // lines suppressed in the last one
+    int64_t now_s = WallTimeUs() / 1000000;
+    int64_t window_s = ff_window_s.load(std::memory_order_relaxed);
+    if (now_s != window_s && ff_window_s.compare_exchange_strong(window_s, now_s)) {
+        ff_lines.store(0, std::memory_order_relaxed);
+        int64_t suppressed = ff_suppressed.exchange(0, std::memory_order_relaxed);
+        if (suppressed > 0) {
+            LogWrite(LOG_LEVEL_WARN, "FFmpeg", "%lld FFmpeg log lines suppressed",
+                     static_cast<long long>(suppressed));
+        }
+    }
+    if (ff_lines.fetch_add(1, std::memory_order_relaxed) >= kFFmpegLinesPerSecond) {
+        ff_suppressed.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    char line[kLogLineSize];
+    thread_local int print_prefix = 1;
+    av_log_format_line(avcl, level, fmt, vl, line, sizeof(line), &print_prefix);
+    size_t length = strlen(line);
+    if (length > 0 && line[length - 1] == '\n') {
+        line[length - 1] = '\0';
+    }
+    LogWrite(log_level, "FFmpeg", "%s", line);
+}
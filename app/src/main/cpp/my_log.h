@@ -5,18 +5,63 @@
 #ifndef MY_LOG_H
 #define MY_LOG_H
 
+#include <cstdarg>
+
 #define LOG_TAG "ffmpeg_encoder"
-#ifdef ANDROID
-#include <android/log.h>
-    #define ILOGD(...) ((void)__android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__))
-    #define ILOGI(...) ((void)__android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__))
-    #define ILOGW(...) ((void)__android_log_print(ANDROID_LOG_WARN, LOG_TAG, __VA_ARGS__))
-    #define ILOGE(...) ((void)__android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__))
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_NONE  4
+
+// Lowest level compiled in, e.g. -DLOG_MIN_LEVEL=LOG_LEVEL_WARN. Calls below
+// it compile to nothing, their arguments are not even evaluated.
+#ifndef LOG_MIN_LEVEL
+#ifdef NDEBUG
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+#endif
+
+#define LOG_ENABLED(level) (LOG_LEVEL_##level >= LOG_MIN_LEVEL)
+
+// Formats the line into a lock-free ring, a background thread writes it to
+// logcat (stderr on the host). Lines are dropped, and counted, if the ring
+// is full, so a caller never blocks on the log.
+void LogWrite(int level, const char* tag, const char* fmt, ...)
+        __attribute__((format(printf, 3, 4)));
+// Waits until every line written so far is out, also done at exit
+void LogFlush();
+// av_log_set_callback() target. Honors av_log_get_level(), goes through the
+// same ring and is rate-limited, a codec spamming warnings costs little.
+void LogFFmpegCallback(void* avcl, int level, const char* fmt, va_list vl);
+
+// Keeps the format checking of a compiled-out call
+static inline int LogDiscard(const char*, ...) __attribute__((format(printf, 1, 2)));
+static inline int LogDiscard(const char*, ...) { return 0; }
+#define ILOG_DISCARD(...) ((void)(false && LogDiscard(__VA_ARGS__)))
+
+#if LOG_ENABLED(DEBUG)
+#define ILOGD(...) LogWrite(LOG_LEVEL_DEBUG, LOG_TAG, __VA_ARGS__)
+#else
+#define ILOGD(...) ILOG_DISCARD(__VA_ARGS__)
+#endif
+#if LOG_ENABLED(INFO)
+#define ILOGI(...) LogWrite(LOG_LEVEL_INFO, LOG_TAG, __VA_ARGS__)
+#else
+#define ILOGI(...) ILOG_DISCARD(__VA_ARGS__)
+#endif
+#if LOG_ENABLED(WARN)
+#define ILOGW(...) LogWrite(LOG_LEVEL_WARN, LOG_TAG, __VA_ARGS__)
+#else
+#define ILOGW(...) ILOG_DISCARD(__VA_ARGS__)
+#endif
+#if LOG_ENABLED(ERROR)
+#define ILOGE(...) LogWrite(LOG_LEVEL_ERROR, LOG_TAG, __VA_ARGS__)
 #else
-#define ILOGD(fmt, ...) printf(" %s " fmt "\n",getTimeFormatForDebug(), ##__VA_ARGS__)
-#define ILOGI(fmt, ...) printf(" %s " fmt "\n",getTimeFormatForDebug(), ##__VA_ARGS__)
-#define ILOGW(fmt, ...) printf(" %s " fmt "\n",getTimeFormatForDebug(), ##__VA_ARGS__)
-#define ILOGE(fmt, ...) printf(" %s " fmt "\n",getTimeFormatForDebug(), ##__VA_ARGS__)
+#define ILOGE(...) ILOG_DISCARD(__VA_ARGS__)
 #endif
 
 #endif //MY_LOG_H
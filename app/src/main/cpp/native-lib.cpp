@@ -1,26 +1,30 @@
 #include "ffmpeg_encoder.h"
+#include "encode_pipeline.h"
+#include "trace.h"
 
 #include <jni.h>
 #include <string>
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
+#if ANDROID
+#include <sys/system_properties.h>
+#endif
 extern "C" {
 #include <libavcodec/jni.h>
 }
 #include "my_log.h"
 
-#define FF_LOG_TAG     "FFmpeg"
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO,  FF_LOG_TAG, __VA_ARGS__)
-
-static void log_callback_test(void *ptr, int level, const char *fmt, va_list vl) {
-    va_list vl2;
-    char *line = (char *)malloc(128 * sizeof(char));
-    static int print_prefix = 1;
-    va_copy(vl2, vl);
-    av_log_format_line(ptr, level, fmt, vl2, line, 128, &print_prefix);
-    va_end(vl2);
-    line[127] = '\0';
-    LOGI("%s", line);
-    free(line);
+// Tracing is on demand: "adb shell setprop debug.ffmpeg_encoder.trace 1"
+// on a device, ENCODER_TRACE=1 elsewhere. trace.json is only written then.
+static bool TraceRequested() {
+#if ANDROID
+    char value[PROP_VALUE_MAX] = {};
+    __system_property_get("debug.ffmpeg_encoder.trace", value);
+#else
+    const char *value = getenv("ENCODER_TRACE");
+#endif
+    return value && strcmp(value, "1") == 0;
 }
 
 int my_main(const char* prefix_path) {
@@ -422,6 +426,9 @@ int my_main(const char* prefix_path) {
 
     // Start time
     auto start = std::chrono::high_resolution_clock::now();
+#if ENABLE_TRACE
+    Tracer::Enable(TraceRequested());
+#endif
 
 #if ANDROID
 #if USE_RAW
@@ -434,7 +441,8 @@ int my_main(const char* prefix_path) {
     FFmpegEncoder encoder(FFmpegEncoder::EncoderType::NVENC, 640, 480, false);
 #endif
 
-    av_log_set_callback(log_callback_test);
+    // Filtered, rate-limited and written off the encode threads
+    av_log_set_callback(LogFFmpegCallback);
 
     if (!encoder.Initialize(output_file)) {
         ILOGE("Initialization failed %s", output_file.c_str());
@@ -442,17 +450,44 @@ int my_main(const char* prefix_path) {
         return -1;
     }
 
+#if USE_PIPELINE
+    EncodePipeline pipeline(encoder);
+    pipeline.Start();
     for (const auto& img : input_images) {
         std::string img_path = std::string(prefix_path) + "/" + img;
+        pipeline.Submit(img_path);
+    }
+    if (!pipeline.Finish()) {
+        ILOGE("Failed to encode %d frame(s)", pipeline.FramesFailed());
+    }
+#else
+    constexpr size_t kReadAhead = 4;
+    for (size_t i = 0; i < input_images.size(); ++i) {
+        if (i + kReadAhead < input_images.size()) {
+            encoder.PrefetchFrame(std::string(prefix_path) + "/" + input_images[i + kReadAhead]);
+        }
+        std::string img_path = std::string(prefix_path) + "/" + input_images[i];
         if (!encoder.EncodeFrame(img_path)) {
             ILOGE("Failed to encode frame: %s", img_path.c_str());
         }
     }
+#endif
 
     // End time
     auto end = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end-start).count();
-    ILOGD("Encoding duration %lld(ms)", duration);
+    ILOGI("Encoding duration %lld(ms)", duration);
+#if ENABLE_TRACE
+    if (Tracer::Enabled()) {
+        // Open in chrome://tracing or ui.perfetto.dev to see which stage stalled
+        const std::string trace_file = prefix_path + std::string("/trace.json");
+        if (!Tracer::WriteChromeTrace(trace_file)) {
+            ILOGE("Could not write the trace to %s", trace_file.c_str());
+        }
+        Tracer::Enable(false);
+        Tracer::Clear();
+    }
+#endif
 
     return 0;
 }
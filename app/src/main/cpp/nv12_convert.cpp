@@ -0,0 +1,185 @@
+#include "nv12_convert.h"
+
+#include <cstring>
+
+static inline uint8_t RgbToY(int r, int g, int b) {
+    return static_cast<uint8_t>(((kYR * r + kYG * g + kYB * b + 128) >> 8) + 16);
+}
+
+static inline uint8_t RgbToU(int r, int g, int b) {
+    return static_cast<uint8_t>(((kUR * r + kUG * g + kUB * b + 128) >> 8) + 128);
+}
+
+static inline uint8_t RgbToV(int r, int g, int b) {
+    return static_cast<uint8_t>(((kVR * r + kVG * g + kVB * b + 128) >> 8) + 128);
+}
+
+void Bgr24ToNv12RowPairTail_C(const uint8_t *src0, const uint8_t *src1,
+                              uint8_t *y0, uint8_t *y1, uint8_t *uv, int start, int width) {
+    for (int x = start; x < width; x += 2) {
+        // Odd width: the last chroma sample reuses the last column
+        int x1 = x + 1 < width ? x + 1 : x;
+        const uint8_t *p00 = src0 + 3 * x;
+        const uint8_t *p01 = src0 + 3 * x1;
+        const uint8_t *p10 = src1 + 3 * x;
+        const uint8_t *p11 = src1 + 3 * x1;
+
+        y0[x] = RgbToY(p00[2], p00[1], p00[0]);
+        y1[x] = RgbToY(p10[2], p10[1], p10[0]);
+        if (x1 != x) {
+            y0[x1] = RgbToY(p01[2], p01[1], p01[0]);
+            y1[x1] = RgbToY(p11[2], p11[1], p11[0]);
+        }
+
+        int b = (p00[0] + p01[0] + p10[0] + p11[0] + 2) >> 2;
+        int g = (p00[1] + p01[1] + p10[1] + p11[1] + 2) >> 2;
+        int r = (p00[2] + p01[2] + p10[2] + p11[2] + 2) >> 2;
+        uv[x] = RgbToU(r, g, b);
+        uv[x + 1] = RgbToV(r, g, b);
+    }
+}
+
+void Bgr24ToNv12RowPair_C(const uint8_t *src0, const uint8_t *src1,
+                          uint8_t *y0, uint8_t *y1, uint8_t *uv, int width) {
+    Bgr24ToNv12RowPairTail_C(src0, src1, y0, y1, uv, 0, width);
+}
+
+void SwapUVRow_C(const uint8_t *src, uint8_t *dst, int pairs) {
+    for (int i = 0; i < pairs; ++i) {
+        uint8_t v = src[2 * i];
+        dst[2 * i] = src[2 * i + 1];
+        dst[2 * i + 1] = v;
+    }
+}
+
+void InterleaveUVRow_C(const uint8_t *u, const uint8_t *v, uint8_t *uv, int n) {
+    for (int i = 0; i < n; ++i) {
+        uv[2 * i] = u[i];
+        uv[2 * i + 1] = v[i];
+    }
+}
+
+void RangeRow_C(const uint8_t *src, uint8_t *dst, int n, int mul, int add) {
+    for (int i = 0; i < n; ++i) {
+        dst[i] = static_cast<uint8_t>((src[i] * mul + add) >> 8);
+    }
+}
+
+struct Nv12Kernel {
+    Bgr24ToNv12RowPairFn row_pair;
+    SwapUVRowFn          swap_uv;
+    InterleaveUVRowFn    interleave_uv;
+    RangeRowFn           range;
+    const char          *name;
+};
+
+static Nv12Kernel SelectKernel() {
+#if defined(__aarch64__)
+    // NEON is mandatory on arm64
+    return {Bgr24ToNv12RowPair_NEON, SwapUVRow_NEON, InterleaveUVRow_NEON, RangeRow_NEON,
+            "neon"};
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return {Bgr24ToNv12RowPair_AVX2, SwapUVRow_AVX2, InterleaveUVRow_AVX2, RangeRow_AVX2,
+                "avx2"};
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return {Bgr24ToNv12RowPair_SSE41, SwapUVRow_SSE41, InterleaveUVRow_SSE41, RangeRow_SSE41,
+                "sse4.1"};
+    }
+    return {Bgr24ToNv12RowPair_C, SwapUVRow_C, InterleaveUVRow_C, RangeRow_C, "c"};
+#else
+    return {Bgr24ToNv12RowPair_C, SwapUVRow_C, InterleaveUVRow_C, RangeRow_C, "c"};
+#endif
+}
+
+static const Nv12Kernel &GetKernel() {
+    static const Nv12Kernel kernel = SelectKernel();
+    return kernel;
+}
+
+const char *Bgr24ToNv12KernelName() {
+    return GetKernel().name;
+}
+
+int Bgr24ToNv12Kernels(Bgr24ToNv12Kernel *kernels, int max_kernels) {
+    int count = 0;
+    auto add = [&](const char *name, Bgr24ToNv12RowPairFn row_pair) {
+        if (count < max_kernels) {
+            kernels[count++] = {name, row_pair};
+        }
+    };
+#if defined(__aarch64__)
+    add("neon", Bgr24ToNv12RowPair_NEON);
+#elif defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        add("avx2", Bgr24ToNv12RowPair_AVX2);
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        add("sse4.1", Bgr24ToNv12RowPair_SSE41);
+    }
+#endif
+    add("c", Bgr24ToNv12RowPair_C);
+    return count;
+}
+
+void Bgr24ToNv12(const uint8_t *src, int src_stride,
+                 uint8_t *dst_y, int dst_y_stride,
+                 uint8_t *dst_uv, int dst_uv_stride,
+                 int width, int height) {
+    Bgr24ToNv12With(GetKernel().row_pair, src, src_stride, dst_y, dst_y_stride, dst_uv,
+                    dst_uv_stride, width, height);
+}
+
+void Bgr24ToNv12With(Bgr24ToNv12RowPairFn row_pair, const uint8_t *src, int src_stride,
+                     uint8_t *dst_y, int dst_y_stride, uint8_t *dst_uv, int dst_uv_stride,
+                     int width, int height) {
+    for (int y = 0; y < height; y += 2) {
+        // Odd height: the last luma row is paired with itself
+        int y1 = y + 1 < height ? y + 1 : y;
+        row_pair(src + y * src_stride, src + y1 * src_stride,
+                 dst_y + y * dst_y_stride, dst_y + y1 * dst_y_stride,
+                 dst_uv + (y / 2) * dst_uv_stride, width);
+    }
+}
+
+void Nv21ToNv12Chroma(const uint8_t *src_vu, int src_stride,
+                      uint8_t *dst_uv, int dst_stride,
+                      int width, int chroma_height) {
+    SwapUVRowFn swap_uv = GetKernel().swap_uv;
+    int pairs = (width + 1) / 2;
+    for (int y = 0; y < chroma_height; ++y) {
+        swap_uv(src_vu + y * src_stride, dst_uv + y * dst_stride, pairs);
+    }
+}
+
+void Yuv420pToNv12(const uint8_t *src_y, int src_y_stride,
+                   const uint8_t *src_u, int src_u_stride,
+                   const uint8_t *src_v, int src_v_stride,
+                   uint8_t *dst_y, int dst_y_stride,
+                   uint8_t *dst_uv, int dst_uv_stride,
+                   int width, int height, bool full_range) {
+    const Nv12Kernel &kernel = GetKernel();
+    if (dst_y) {
+        for (int y = 0; y < height; ++y) {
+            uint8_t *row = dst_y + y * dst_y_stride;
+            if (full_range) {
+                kernel.range(src_y + y * src_y_stride, row, width, kRangeYMul, kRangeYAdd);
+            } else {
+                memcpy(row, src_y + y * src_y_stride, width);
+            }
+        }
+    }
+
+    int chroma_width = (width + 1) / 2;
+    for (int y = 0; y < (height + 1) / 2; ++y) {
+        uint8_t *row = dst_uv + y * dst_uv_stride;
+        kernel.interleave_uv(src_u + y * src_u_stride, src_v + y * src_v_stride, row, chroma_width);
+        if (full_range) {
+            // Still in L1 from the interleave
+            kernel.range(row, row, 2 * chroma_width, kRangeCMul, kRangeCAdd);
+        }
+    }
+}
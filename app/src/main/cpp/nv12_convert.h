@@ -0,0 +1,106 @@
+#ifndef NV12_CONVERT_H
+#define NV12_CONVERT_H
+
+#include <cstdint>
+
+// Same-size packed BGR24 -> NV12 conversion (BT.601, limited range), the
+// fast path for what swscale does with SWS_FAST_BILINEAR in ConvertFrame().
+//
+// Work is done one row pair at a time: two luma rows plus the interleaved
+// chroma row they share, so the working set of a pass stays in L1.
+// The SIMD kernel is picked once at runtime from the CPU features.
+void Bgr24ToNv12(const uint8_t* src, int src_stride,
+                 uint8_t* dst_y, int dst_y_stride,
+                 uint8_t* dst_uv, int dst_uv_stride,
+                 int width, int height);
+
+// BT.601 limited range coefficients in Q8, shared by every kernel:
+//   Y = (( 66 R + 129 G +  25 B + 128) >> 8) +  16
+//   U = ((-38 R -  74 G + 112 B + 128) >> 8) + 128
+//   V = ((112 R -  94 G -  18 B + 128) >> 8) + 128
+// U and V are computed from the rounded average of each 2x2 block.
+constexpr int kYR = 66, kYG = 129, kYB = 25;
+constexpr int kUR = -38, kUG = -74, kUB = 112;
+constexpr int kVR = 112, kVG = -94, kVB = -18;
+
+// NV21 -> NV12 chroma: swaps the bytes of every VU pair, the luma plane is
+// identical in both formats and is not touched. width is the luma width.
+void Nv21ToNv12Chroma(const uint8_t* src_vu, int src_stride,
+                      uint8_t* dst_uv, int dst_stride,
+                      int width, int chroma_height);
+
+// Planar 4:2:0 -> NV12 (the usual MJPEG decoder output). Chroma is only
+// interleaved; full-range (JPEG) input is also mapped to limited range:
+//   Y' = (Y * 220 + 4224) >> 8    [0, 255] -> [16, 235]
+//   C' = (C * 225 + 4096) >> 8    [0, 255] -> [16, 240], 128 stays 128
+// For limited-range input dst_y may be null, the source luma can be reused.
+void Yuv420pToNv12(const uint8_t* src_y, int src_y_stride,
+                   const uint8_t* src_u, int src_u_stride,
+                   const uint8_t* src_v, int src_v_stride,
+                   uint8_t* dst_y, int dst_y_stride,
+                   uint8_t* dst_uv, int dst_uv_stride,
+                   int width, int height, bool full_range);
+
+constexpr int kRangeYMul = 220, kRangeYAdd = 4224;
+constexpr int kRangeCMul = 225, kRangeCAdd = 4096;
+
+// Name of the kernel Bgr24ToNv12() dispatches to: "neon", "avx2", "sse4.1" or "c"
+const char* Bgr24ToNv12KernelName();
+
+// Converts the row pair src0/src1 into luma rows y0/y1 and chroma row uv.
+// For an odd last row the caller passes the same row twice.
+typedef void (*Bgr24ToNv12RowPairFn)(const uint8_t* src0, const uint8_t* src1,
+                                     uint8_t* y0, uint8_t* y1, uint8_t* uv, int width);
+
+struct Bgr24ToNv12Kernel {
+  const char*          name;
+  Bgr24ToNv12RowPairFn row_pair;
+};
+
+// Every BGR24 -> NV12 kernel this CPU can run, the one Bgr24ToNv12() picks
+// first and the scalar reference last. Returns how many were written.
+int Bgr24ToNv12Kernels(Bgr24ToNv12Kernel* kernels, int max_kernels);
+// Bgr24ToNv12() with the given kernel instead of the dispatched one
+void Bgr24ToNv12With(Bgr24ToNv12RowPairFn row_pair, const uint8_t* src, int src_stride,
+                     uint8_t* dst_y, int dst_y_stride, uint8_t* dst_uv, int dst_uv_stride,
+                     int width, int height);
+
+// Swaps the two bytes of each of the first pairs 16-bit chroma samples
+typedef void (*SwapUVRowFn)(const uint8_t* src, uint8_t* dst, int pairs);
+
+// Interleaves n U and n V samples into n UV pairs
+typedef void (*InterleaveUVRowFn)(const uint8_t* u, const uint8_t* v, uint8_t* uv, int n);
+// dst[i] = (src[i] * mul + add) >> 8 for n bytes, src and dst may alias
+typedef void (*RangeRowFn)(const uint8_t* src, uint8_t* dst, int n, int mul, int add);
+
+// Scalar reference, the SIMD kernels must match it bit for bit
+void Bgr24ToNv12RowPair_C(const uint8_t* src0, const uint8_t* src1,
+                          uint8_t* y0, uint8_t* y1, uint8_t* uv, int width);
+// Columns [start, width) only, used by the SIMD kernels for the row tail
+void Bgr24ToNv12RowPairTail_C(const uint8_t* src0, const uint8_t* src1,
+                              uint8_t* y0, uint8_t* y1, uint8_t* uv, int start, int width);
+void SwapUVRow_C(const uint8_t* src, uint8_t* dst, int pairs);
+void InterleaveUVRow_C(const uint8_t* u, const uint8_t* v, uint8_t* uv, int n);
+void RangeRow_C(const uint8_t* src, uint8_t* dst, int n, int mul, int add);
+
+#if defined(__aarch64__)
+void Bgr24ToNv12RowPair_NEON(const uint8_t* src0, const uint8_t* src1,
+                             uint8_t* y0, uint8_t* y1, uint8_t* uv, int width);
+void SwapUVRow_NEON(const uint8_t* src, uint8_t* dst, int pairs);
+void InterleaveUVRow_NEON(const uint8_t* u, const uint8_t* v, uint8_t* uv, int n);
+void RangeRow_NEON(const uint8_t* src, uint8_t* dst, int n, int mul, int add);
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+void Bgr24ToNv12RowPair_SSE41(const uint8_t* src0, const uint8_t* src1,
+                              uint8_t* y0, uint8_t* y1, uint8_t* uv, int width);
+void Bgr24ToNv12RowPair_AVX2(const uint8_t* src0, const uint8_t* src1,
+                             uint8_t* y0, uint8_t* y1, uint8_t* uv, int width);
+void SwapUVRow_SSE41(const uint8_t* src, uint8_t* dst, int pairs);
+void SwapUVRow_AVX2(const uint8_t* src, uint8_t* dst, int pairs);
+void InterleaveUVRow_SSE41(const uint8_t* u, const uint8_t* v, uint8_t* uv, int n);
+void InterleaveUVRow_AVX2(const uint8_t* u, const uint8_t* v, uint8_t* uv, int n);
+void RangeRow_SSE41(const uint8_t* src, uint8_t* dst, int n, int mul, int add);
+void RangeRow_AVX2(const uint8_t* src, uint8_t* dst, int n, int mul, int add);
+#endif
+
+#endif /* NV12_CONVERT_H */
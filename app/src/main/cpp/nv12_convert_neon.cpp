@@ -0,0 +1,104 @@
+#include "nv12_convert.h"
+
+#if defined(__aarch64__)
+
+#include <arm_neon.h>
+
+// 16 pixels of 8-bit B/G/R -> 16 luma bytes. The weighted sum fits an
+// unsigned 16-bit lane and vrshrn does the +128 >> 8 rounding.
+static inline uint8x16_t LumaNEON(uint8x16x3_t bgr) {
+    const uint8x8_t yr = vdup_n_u8(kYR), yg = vdup_n_u8(kYG), yb = vdup_n_u8(kYB);
+
+    uint16x8_t lo = vmull_u8(vget_low_u8(bgr.val[2]), yr);
+    lo = vmlal_u8(lo, vget_low_u8(bgr.val[1]), yg);
+    lo = vmlal_u8(lo, vget_low_u8(bgr.val[0]), yb);
+    uint16x8_t hi = vmull_u8(vget_high_u8(bgr.val[2]), yr);
+    hi = vmlal_u8(hi, vget_high_u8(bgr.val[1]), yg);
+    hi = vmlal_u8(hi, vget_high_u8(bgr.val[0]), yb);
+
+    uint8x16_t y = vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8));
+    return vaddq_u8(y, vdupq_n_u8(16));
+}
+
+// c = ((cr R + cg G + cb B + 128) >> 8) + 128 on 16-bit 2x2 averages
+static inline uint8x8_t ChromaNEON(int16x8_t b, int16x8_t g, int16x8_t r,
+                                   int16_t cr, int16_t cg, int16_t cb) {
+    int16x8_t c = vmulq_n_s16(r, cr);
+    c = vmlaq_n_s16(c, g, cg);
+    c = vmlaq_n_s16(c, b, cb);
+    c = vshrq_n_s16(vaddq_s16(c, vdupq_n_s16(128)), 8);
+    return vqmovun_s16(vaddq_s16(c, vdupq_n_s16(128)));
+}
+
+static inline int16x8_t Average2x2NEON(uint8x16_t row0, uint8x16_t row1) {
+    uint16x8_t sum = vpadalq_u8(vpaddlq_u8(row0), row1);
+    return vreinterpretq_s16_u16(vrshrq_n_u16(sum, 2));
+}
+
+void Bgr24ToNv12RowPair_NEON(const uint8_t *src0, const uint8_t *src1,
+                             uint8_t *y0, uint8_t *y1, uint8_t *uv, int width) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x3_t bgr0 = vld3q_u8(src0 + 3 * x);
+        uint8x16x3_t bgr1 = vld3q_u8(src1 + 3 * x);
+
+        vst1q_u8(y0 + x, LumaNEON(bgr0));
+        vst1q_u8(y1 + x, LumaNEON(bgr1));
+
+        int16x8_t b = Average2x2NEON(bgr0.val[0], bgr1.val[0]);
+        int16x8_t g = Average2x2NEON(bgr0.val[1], bgr1.val[1]);
+        int16x8_t r = Average2x2NEON(bgr0.val[2], bgr1.val[2]);
+        uint8x8x2_t chroma;
+        chroma.val[0] = ChromaNEON(b, g, r, kUR, kUG, kUB);
+        chroma.val[1] = ChromaNEON(b, g, r, kVR, kVG, kVB);
+        vst2_u8(uv + x, chroma);
+    }
+    if (x < width) {
+        Bgr24ToNv12RowPairTail_C(src0, src1, y0, y1, uv, x, width);
+    }
+}
+
+void SwapUVRow_NEON(const uint8_t *src, uint8_t *dst, int pairs) {
+    int i = 0;
+    for (; i + 16 <= pairs; i += 16) {
+        uint8x16x2_t vu = vld2q_u8(src + 2 * i);
+        uint8x16x2_t uv;
+        uv.val[0] = vu.val[1];
+        uv.val[1] = vu.val[0];
+        vst2q_u8(dst + 2 * i, uv);
+    }
+    if (i < pairs) {
+        SwapUVRow_C(src + 2 * i, dst + 2 * i, pairs - i);
+    }
+}
+
+void InterleaveUVRow_NEON(const uint8_t *u, const uint8_t *v, uint8_t *uv, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x2_t pairs;
+        pairs.val[0] = vld1q_u8(u + i);
+        pairs.val[1] = vld1q_u8(v + i);
+        vst2q_u8(uv + 2 * i, pairs);
+    }
+    if (i < n) {
+        InterleaveUVRow_C(u + i, v + i, uv + 2 * i, n - i);
+    }
+}
+
+// mul <= 255 and add < 2^16 - 255 * mul for every caller, so 16 bits suffice
+void RangeRow_NEON(const uint8_t *src, uint8_t *dst, int n, int mul, int add) {
+    const uint8x8_t m = vdup_n_u8(static_cast<uint8_t>(mul));
+    const uint16x8_t a = vdupq_n_u16(static_cast<uint16_t>(add));
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t in = vld1q_u8(src + i);
+        uint16x8_t lo = vmlal_u8(a, vget_low_u8(in), m);
+        uint16x8_t hi = vmlal_u8(a, vget_high_u8(in), m);
+        vst1q_u8(dst + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+    }
+    if (i < n) {
+        RangeRow_C(src + i, dst + i, n - i, mul, add);
+    }
+}
+
+#endif
@@ -0,0 +1,257 @@
+#include "nv12_convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+// Both kernels are built with per-function target attributes, so the file
+// needs no extra compiler flags and the baseline build still runs anywhere.
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2  __attribute__((target("avx2")))
+
+// Split 16 packed BGR24 pixels (48 bytes) into B, G and R byte vectors
+TARGET_SSE41 static inline void DeinterleaveBgr16(const uint8_t *src,
+                                                  __m128i &b, __m128i &g, __m128i &r) {
+    const __m128i in0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+    const __m128i in1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 16));
+    const __m128i in2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 32));
+
+    const __m128i b0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+    const __m128i b2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+    const __m128i g0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i g1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+    const __m128i g2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+    const __m128i r0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i r1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+    const __m128i r2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+
+    b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(in0, b0), _mm_shuffle_epi8(in1, b1)),
+                     _mm_shuffle_epi8(in2, b2));
+    g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(in0, g0), _mm_shuffle_epi8(in1, g1)),
+                     _mm_shuffle_epi8(in2, g2));
+    r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(in0, r0), _mm_shuffle_epi8(in1, r1)),
+                     _mm_shuffle_epi8(in2, r2));
+}
+
+// 8 lanes of 16-bit B/G/R -> 8 lanes of 16-bit Y. The weighted sum of 8-bit
+// inputs fits in an unsigned 16-bit lane, so a logical shift is enough.
+TARGET_SSE41 static inline __m128i LumaSSE(__m128i b, __m128i g, __m128i r) {
+    __m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(kYR)),
+                              _mm_mullo_epi16(g, _mm_set1_epi16(kYG)));
+    y = _mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(kYB)));
+    y = _mm_srli_epi16(_mm_add_epi16(y, _mm_set1_epi16(128)), 8);
+    return _mm_add_epi16(y, _mm_set1_epi16(16));
+}
+
+// Signed chroma term for 16-bit averages, c = ((cr R + cg G + cb B + 128) >> 8) + 128
+TARGET_SSE41 static inline __m128i ChromaSSE(__m128i b, __m128i g, __m128i r,
+                                             int cr, int cg, int cb) {
+    __m128i c = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(cr)),
+                              _mm_mullo_epi16(g, _mm_set1_epi16(cg)));
+    c = _mm_add_epi16(c, _mm_mullo_epi16(b, _mm_set1_epi16(cb)));
+    c = _mm_srai_epi16(_mm_add_epi16(c, _mm_set1_epi16(128)), 8);
+    return _mm_add_epi16(c, _mm_set1_epi16(128));
+}
+
+// Sum of horizontal pixel pairs from two rows, rounded to the 2x2 average
+TARGET_SSE41 static inline __m128i Average2x2SSE(__m128i row0_lo, __m128i row0_hi,
+                                                 __m128i row1_lo, __m128i row1_hi) {
+    __m128i sum = _mm_add_epi16(_mm_hadd_epi16(row0_lo, row0_hi),
+                                _mm_hadd_epi16(row1_lo, row1_hi));
+    return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+TARGET_SSE41 void Bgr24ToNv12RowPair_SSE41(const uint8_t *src0, const uint8_t *src1,
+                                           uint8_t *y0, uint8_t *y1, uint8_t *uv, int width) {
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i b0, g0, r0, b1, g1, r1;
+        DeinterleaveBgr16(src0 + 3 * x, b0, g0, r0);
+        DeinterleaveBgr16(src1 + 3 * x, b1, g1, r1);
+
+        __m128i b0l = _mm_cvtepu8_epi16(b0), b0h = _mm_unpackhi_epi8(b0, zero);
+        __m128i g0l = _mm_cvtepu8_epi16(g0), g0h = _mm_unpackhi_epi8(g0, zero);
+        __m128i r0l = _mm_cvtepu8_epi16(r0), r0h = _mm_unpackhi_epi8(r0, zero);
+        __m128i b1l = _mm_cvtepu8_epi16(b1), b1h = _mm_unpackhi_epi8(b1, zero);
+        __m128i g1l = _mm_cvtepu8_epi16(g1), g1h = _mm_unpackhi_epi8(g1, zero);
+        __m128i r1l = _mm_cvtepu8_epi16(r1), r1h = _mm_unpackhi_epi8(r1, zero);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(y0 + x),
+                         _mm_packus_epi16(LumaSSE(b0l, g0l, r0l), LumaSSE(b0h, g0h, r0h)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(y1 + x),
+                         _mm_packus_epi16(LumaSSE(b1l, g1l, r1l), LumaSSE(b1h, g1h, r1h)));
+
+        __m128i b = Average2x2SSE(b0l, b0h, b1l, b1h);
+        __m128i g = Average2x2SSE(g0l, g0h, g1l, g1h);
+        __m128i r = Average2x2SSE(r0l, r0h, r1l, r1h);
+        // U and V always land in [16, 240], so they can be merged without saturation
+        __m128i u = ChromaSSE(b, g, r, kUR, kUG, kUB);
+        __m128i v = ChromaSSE(b, g, r, kVR, kVG, kVB);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(uv + x),
+                         _mm_or_si128(u, _mm_slli_epi16(v, 8)));
+    }
+    if (x < width) {
+        Bgr24ToNv12RowPairTail_C(src0, src1, y0, y1, uv, x, width);
+    }
+}
+
+TARGET_SSE41 void SwapUVRow_SSE41(const uint8_t *src, uint8_t *dst, int pairs) {
+    int i = 0;
+    for (; i + 8 <= pairs; i += 8) {
+        __m128i vu = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * i));
+        __m128i uv = _mm_or_si128(_mm_slli_epi16(vu, 8), _mm_srli_epi16(vu, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 2 * i), uv);
+    }
+    if (i < pairs) {
+        SwapUVRow_C(src + 2 * i, dst + 2 * i, pairs - i);
+    }
+}
+
+TARGET_AVX2 static inline __m256i LumaAVX2(__m256i b, __m256i g, __m256i r) {
+    __m256i y = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(kYR)),
+                                 _mm256_mullo_epi16(g, _mm256_set1_epi16(kYG)));
+    y = _mm256_add_epi16(y, _mm256_mullo_epi16(b, _mm256_set1_epi16(kYB)));
+    y = _mm256_srli_epi16(_mm256_add_epi16(y, _mm256_set1_epi16(128)), 8);
+    return _mm256_add_epi16(y, _mm256_set1_epi16(16));
+}
+
+TARGET_AVX2 static inline __m256i ChromaAVX2(__m256i b, __m256i g, __m256i r,
+                                             int cr, int cg, int cb) {
+    __m256i c = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(cr)),
+                                 _mm256_mullo_epi16(g, _mm256_set1_epi16(cg)));
+    c = _mm256_add_epi16(c, _mm256_mullo_epi16(b, _mm256_set1_epi16(cb)));
+    c = _mm256_srai_epi16(_mm256_add_epi16(c, _mm256_set1_epi16(128)), 8);
+    return _mm256_add_epi16(c, _mm256_set1_epi16(128));
+}
+
+// hadd works per 128-bit lane, the permute restores pixel order afterwards
+TARGET_AVX2 static inline __m256i Average2x2AVX2(__m256i row0_a, __m256i row0_b,
+                                                 __m256i row1_a, __m256i row1_b) {
+    __m256i sum = _mm256_add_epi16(_mm256_hadd_epi16(row0_a, row0_b),
+                                   _mm256_hadd_epi16(row1_a, row1_b));
+    sum = _mm256_permute4x64_epi64(sum, _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(2)), 2);
+}
+
+TARGET_AVX2 static inline __m256i PackLumaAVX2(__m256i lo, __m256i hi) {
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+TARGET_AVX2 void Bgr24ToNv12RowPair_AVX2(const uint8_t *src0, const uint8_t *src1,
+                                         uint8_t *y0, uint8_t *y1, uint8_t *uv, int width) {
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        // BGR24 does not split across 256-bit lanes nicely, deinterleave
+        // with 128-bit shuffles and do the arithmetic 16 pixels wide
+        __m128i b0a, g0a, r0a, b0b, g0b, r0b, b1a, g1a, r1a, b1b, g1b, r1b;
+        DeinterleaveBgr16(src0 + 3 * x, b0a, g0a, r0a);
+        DeinterleaveBgr16(src0 + 3 * x + 48, b0b, g0b, r0b);
+        DeinterleaveBgr16(src1 + 3 * x, b1a, g1a, r1a);
+        DeinterleaveBgr16(src1 + 3 * x + 48, b1b, g1b, r1b);
+
+        __m256i B0a = _mm256_cvtepu8_epi16(b0a), B0b = _mm256_cvtepu8_epi16(b0b);
+        __m256i G0a = _mm256_cvtepu8_epi16(g0a), G0b = _mm256_cvtepu8_epi16(g0b);
+        __m256i R0a = _mm256_cvtepu8_epi16(r0a), R0b = _mm256_cvtepu8_epi16(r0b);
+        __m256i B1a = _mm256_cvtepu8_epi16(b1a), B1b = _mm256_cvtepu8_epi16(b1b);
+        __m256i G1a = _mm256_cvtepu8_epi16(g1a), G1b = _mm256_cvtepu8_epi16(g1b);
+        __m256i R1a = _mm256_cvtepu8_epi16(r1a), R1b = _mm256_cvtepu8_epi16(r1b);
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(y0 + x),
+                            PackLumaAVX2(LumaAVX2(B0a, G0a, R0a), LumaAVX2(B0b, G0b, R0b)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(y1 + x),
+                            PackLumaAVX2(LumaAVX2(B1a, G1a, R1a), LumaAVX2(B1b, G1b, R1b)));
+
+        __m256i b = Average2x2AVX2(B0a, B0b, B1a, B1b);
+        __m256i g = Average2x2AVX2(G0a, G0b, G1a, G1b);
+        __m256i r = Average2x2AVX2(R0a, R0b, R1a, R1b);
+        __m256i u = ChromaAVX2(b, g, r, kUR, kUG, kUB);
+        __m256i v = ChromaAVX2(b, g, r, kVR, kVG, kVB);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(uv + x),
+                            _mm256_or_si256(u, _mm256_slli_epi16(v, 8)));
+    }
+    if (x < width) {
+        Bgr24ToNv12RowPair_SSE41(src0 + 3 * x, src1 + 3 * x, y0 + x, y1 + x, uv + x, width - x);
+    }
+}
+
+TARGET_AVX2 void SwapUVRow_AVX2(const uint8_t *src, uint8_t *dst, int pairs) {
+    int i = 0;
+    for (; i + 16 <= pairs; i += 16) {
+        __m256i vu = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 2 * i));
+        __m256i uv = _mm256_or_si256(_mm256_slli_epi16(vu, 8), _mm256_srli_epi16(vu, 8));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + 2 * i), uv);
+    }
+    if (i < pairs) {
+        SwapUVRow_SSE41(src + 2 * i, dst + 2 * i, pairs - i);
+    }
+}
+
+TARGET_SSE41 void InterleaveUVRow_SSE41(const uint8_t *u, const uint8_t *v, uint8_t *uv, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i us = _mm_loadu_si128(reinterpret_cast<const __m128i *>(u + i));
+        __m128i vs = _mm_loadu_si128(reinterpret_cast<const __m128i *>(v + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(uv + 2 * i), _mm_unpacklo_epi8(us, vs));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(uv + 2 * i + 16), _mm_unpackhi_epi8(us, vs));
+    }
+    if (i < n) {
+        InterleaveUVRow_C(u + i, v + i, uv + 2 * i, n - i);
+    }
+}
+
+TARGET_AVX2 void InterleaveUVRow_AVX2(const uint8_t *u, const uint8_t *v, uint8_t *uv, int n) {
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i us = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(u + i));
+        __m256i vs = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(v + i));
+        // unpack works per 128-bit lane, regroup the lanes before storing
+        __m256i lo = _mm256_unpacklo_epi8(us, vs);
+        __m256i hi = _mm256_unpackhi_epi8(us, vs);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(uv + 2 * i),
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(uv + 2 * i + 32),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    if (i < n) {
+        InterleaveUVRow_SSE41(u + i, v + i, uv + 2 * i, n - i);
+    }
+}
+
+// mul <= 255 and add < 2^16 - 255 * mul for every caller, so 16 bits suffice
+TARGET_SSE41 void RangeRow_SSE41(const uint8_t *src, uint8_t *dst, int n, int mul, int add) {
+    const __m128i m = _mm_set1_epi16(static_cast<short>(mul));
+    const __m128i a = _mm_set1_epi16(static_cast<short>(add));
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_cvtepu8_epi16(in), m), a), 8);
+        __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(in, zero), m), a), 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    if (i < n) {
+        RangeRow_C(src + i, dst + i, n - i, mul, add);
+    }
+}
+
+TARGET_AVX2 void RangeRow_AVX2(const uint8_t *src, uint8_t *dst, int n, int mul, int add) {
+    const __m256i m = _mm256_set1_epi16(static_cast<short>(mul));
+    const __m256i a = _mm256_set1_epi16(static_cast<short>(add));
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m128i in0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m128i in1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i + 16));
+        __m256i lo = _mm256_srli_epi16(
+                _mm256_add_epi16(_mm256_mullo_epi16(_mm256_cvtepu8_epi16(in0), m), a), 8);
+        __m256i hi = _mm256_srli_epi16(
+                _mm256_add_epi16(_mm256_mullo_epi16(_mm256_cvtepu8_epi16(in1), m), a), 8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), PackLumaAVX2(lo, hi));
+    }
+    if (i < n) {
+        RangeRow_SSE41(src + i, dst + i, n - i, mul, add);
+    }
+}
+
+#endif
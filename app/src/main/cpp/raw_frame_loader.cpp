@@ -0,0 +1,66 @@
+#include "raw_frame_loader.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+
+#include "my_log.h"
+
+static void UnmapBuffer(void *opaque, uint8_t *data) {
+    munmap(data, static_cast<size_t>(reinterpret_cast<uintptr_t>(opaque)));
+}
+
+AVBufferRef *MapRawFrame(const std::string &path, size_t min_size) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ILOGE("Could not open the image file: %s", path.c_str());
+        return nullptr;
+    }
+
+    struct stat st = {};
+    if (fstat(fd, &st) < 0) {
+        ILOGE("Could not stat the image file: %s", path.c_str());
+        close(fd);
+        return nullptr;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    if (size < min_size) {
+        ILOGE("Image file %s is too small: %zu < %zu", path.c_str(), size, min_size);
+        close(fd);
+        return nullptr;
+    }
+
+    void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file alive on its own
+    close(fd);
+    if (data == MAP_FAILED) {
+        ILOGE("Could not map the image file: %s", path.c_str());
+        return nullptr;
+    }
+    // The converter walks the frame top to bottom exactly once
+    madvise(data, size, MADV_SEQUENTIAL);
+    madvise(data, size, MADV_WILLNEED);
+
+    AVBufferRef *buffer = av_buffer_create(static_cast<uint8_t *>(data), size, UnmapBuffer,
+                                           reinterpret_cast<void *>(static_cast<uintptr_t>(size)),
+                                           AV_BUFFER_FLAG_READONLY);
+    if (!buffer) {
+        ILOGE("Could not wrap the mapping of %s", path.c_str());
+        munmap(data, size);
+        return nullptr;
+    }
+    return buffer;
+}
+
+void PrefetchRawFrame(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    // Read-ahead is queued in the kernel and outlives the descriptor
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
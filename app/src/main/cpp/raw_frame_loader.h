@@ -0,0 +1,21 @@
+#ifndef RAW_FRAME_LOADER_H
+#define RAW_FRAME_LOADER_H
+
+extern "C" {
+#include <libavutil/buffer.h>
+}
+
+#include <cstddef>
+#include <string>
+
+// Maps a raw frame file read-only and wraps the mapping as a refcounted
+// buffer, the file is unmapped when the last reference goes away. The
+// pixels are used in place, nothing is copied out of the page cache.
+// Returns nullptr if the file cannot be mapped or is smaller than min_size.
+AVBufferRef* MapRawFrame(const std::string& path, size_t min_size);
+
+// Asks the kernel to start reading a file we are about to map, so the
+// page faults in MapRawFrame() hit the page cache instead of storage
+void PrefetchRawFrame(const std::string& path);
+
+#endif /* RAW_FRAME_LOADER_H */
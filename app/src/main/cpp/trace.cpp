@@ -0,0 +1,215 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Spans kept per thread, about 160 KB each
+constexpr uint64_t kTraceCapacity = 4096;
+// Thread names longer than this are cut
+constexpr size_t kMaxThreadName = 32;
+
+namespace {
+
+// One slot of the ring. seq is odd while the owner writes the slot, a reader
+// only keeps a copy taken while seq was even and unchanged (a seqlock).
+struct TraceEvent {
+  std::atomic<uint64_t>    seq{0};
+  std::atomic<const char*> name{nullptr};
+  std::atomic<int64_t>     frame{0};
+  std::atomic<int64_t>     begin_us{0};
+  std::atomic<int64_t>     end_us{0};
+};
+
+struct ThreadTrace {
+  int                   tid;
+  std::string           name;  // Guarded by the registry mutex
+  std::atomic<uint64_t> head{0};
+  std::atomic<uint64_t> cleared{0};  // Spans before this index are not exported
+  TraceEvent            events[kTraceCapacity];
+};
+
+struct Registry {
+  std::mutex                                mutex;
+  std::vector<std::unique_ptr<ThreadTrace>> threads;  // Kept after their thread exits
+  std::vector<ThreadTrace*>                 free;     // Rings of exited threads
+  int                                       next_tid = 0;
+};
+
+Registry &GetRegistry() {
+    static Registry registry;
+    return registry;
+}
+
+// Hands the ring back when its thread exits. Its spans stay exportable until
+// a new thread takes the ring over, so threads that come and go (e.g. one
+// file writer per segment) reuse a few rings instead of adding one each.
+struct ThreadRing {
+  ThreadTrace *trace = nullptr;
+
+  ~ThreadRing() {
+      if (trace) {
+          Registry &registry = GetRegistry();
+          std::lock_guard<std::mutex> lock(registry.mutex);
+          registry.free.push_back(trace);
+      }
+  }
+};
+
+std::atomic<bool> g_enabled(false);
+thread_local ThreadRing t_ring;
+thread_local char t_name[kMaxThreadName] = {};
+thread_local int64_t t_frame = -1;
+
+// The calling thread's ring, set up by the first span it records
+ThreadTrace &CurrentThread() {
+    if (!t_ring.trace) {
+        Registry &registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        ThreadTrace *trace;
+        if (!registry.free.empty()) {
+            trace = registry.free.back();
+            registry.free.pop_back();
+            // The previous owner's spans are dropped, the new owner gets a tid of its own
+            trace->cleared.store(trace->head.load(std::memory_order_relaxed));
+        } else {
+            registry.threads.emplace_back(new ThreadTrace());
+            trace = registry.threads.back().get();
+        }
+        trace->tid = ++registry.next_tid;
+        trace->name = t_name;
+        t_ring.trace = trace;
+    }
+    return *t_ring.trace;
+}
+
+void WriteJsonString(FILE *file, const char *s) {
+    fputc('"', file);
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', file);
+        }
+        fputc(*s, file);
+    }
+    fputc('"', file);
+}
+
+}  // namespace
+
+void Tracer::Enable(bool enabled) {
+    g_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+bool Tracer::Enabled() {
+    return g_enabled.load(std::memory_order_relaxed);
+}
+
+int64_t Tracer::NowUs() {
+    static const auto epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - epoch).count();
+}
+
+void Tracer::SetThreadName(const char *name) {
+    // Only remembered here, a ring is taken once the thread records a span
+    strncpy(t_name, name, kMaxThreadName - 1);
+    if (t_ring.trace) {
+        std::lock_guard<std::mutex> lock(GetRegistry().mutex);
+        t_ring.trace->name = t_name;
+    }
+}
+
+void Tracer::Record(const char *name, int64_t frame, int64_t begin_us, int64_t end_us) {
+    ThreadTrace &trace = CurrentThread();
+    uint64_t head = trace.head.load(std::memory_order_relaxed);
+    TraceEvent &event = trace.events[head % kTraceCapacity];
+
+    event.seq.store(2 * head + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    event.name.store(name, std::memory_order_relaxed);
+    event.frame.store(frame, std::memory_order_relaxed);
+    event.begin_us.store(begin_us, std::memory_order_relaxed);
+    event.end_us.store(end_us, std::memory_order_relaxed);
+    event.seq.store(2 * head + 2, std::memory_order_release);
+    trace.head.store(head + 1, std::memory_order_release);
+}
+
+void Tracer::Clear() {
+    Registry &registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (auto &trace : registry.threads) {
+        // head belongs to the recording thread, only the export window moves
+        trace->cleared.store(trace->head.load(std::memory_order_acquire));
+    }
+}
+
+bool Tracer::WriteChromeTrace(const std::string &path) {
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+
+    Registry &registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    fputs("{\"traceEvents\":[", file);
+    bool first = true;
+    for (auto &trace : registry.threads) {
+        if (!trace->name.empty()) {
+            fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,"
+                          "\"args\":{\"name\":", first ? "" : ",", trace->tid);
+            WriteJsonString(file, trace->name.c_str());
+            fputs("}}", file);
+            first = false;
+        }
+
+        uint64_t head = trace->head.load(std::memory_order_acquire);
+        uint64_t begin = head > kTraceCapacity ? head - kTraceCapacity : 0;
+        begin = std::max(begin, trace->cleared.load());
+        for (uint64_t i = begin; i < head; ++i) {
+            TraceEvent &event = trace->events[i % kTraceCapacity];
+            uint64_t seq = event.seq.load(std::memory_order_acquire);
+            const char *name = event.name.load(std::memory_order_relaxed);
+            int64_t frame = event.frame.load(std::memory_order_relaxed);
+            int64_t begin_us = event.begin_us.load(std::memory_order_relaxed);
+            int64_t end_us = event.end_us.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // Skip slots overwritten or being written since head was read
+            if (seq != 2 * i + 2 || event.seq.load(std::memory_order_relaxed) != seq || !name) {
+                continue;
+            }
+            fprintf(file, "%s{\"ph\":\"X\",\"name\":", first ? "" : ",");
+            WriteJsonString(file, name);
+            fprintf(file, ",\"pid\":1,\"tid\":%d,\"ts\":%" PRId64 ",\"dur\":%" PRId64
+                          ",\"args\":{\"frame\":%" PRId64 "}}",
+                    trace->tid, begin_us, end_us - begin_us, frame);
+            first = false;
+        }
+    }
+    fputs("]}\n", file);
+    return fclose(file) == 0;
+}
+
+TraceSpan::TraceSpan(const char *name, int64_t frame)
+        : name_(name), frame_(frame < 0 ? t_frame : frame), outer_frame_(t_frame), begin_us_(-1) {
+    if (Tracer::Enabled()) {
+        begin_us_ = Tracer::NowUs();
+    }
+    t_frame = frame_;
+}
+
+TraceSpan::~TraceSpan() {
+    t_frame = outer_frame_;
+    if (begin_us_ >= 0) {
+        Tracer::Record(name_, frame_, begin_us_, Tracer::NowUs());
+    }
+}
+
+void TraceSpan::SetFrame(int64_t frame) {
+    frame_ = frame;
+}
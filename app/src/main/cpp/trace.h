@@ -0,0 +1,72 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+#include <string>
+
+// Per-stage tracing, exported as Chrome trace JSON for chrome://tracing or
+// ui.perfetto.dev.
+//
+// A span records its stage name, frame index, thread and duration into a
+// fixed ring owned by the recording thread, without locks; once a ring is
+// full its oldest spans are overwritten. A thread takes a ring with its
+// first span and hands it back when it exits, for the next new thread to
+// reuse, so short-lived threads do not add up. Recording is off until
+// Tracer::Enable(true), until then a span costs one relaxed atomic load.
+// Building with ENABLE_TRACE=0 compiles the spans out entirely.
+#ifndef ENABLE_TRACE
+#define ENABLE_TRACE 1
+#endif
+
+class Tracer {
+ public:
+  static void Enable(bool enabled);
+  static bool Enabled();
+  // Names the calling thread in the exported trace
+  static void SetThreadName(const char* name);
+  // Writes every buffered span, false if the file cannot be written
+  static bool WriteChromeTrace(const std::string& path);
+  // Drops every buffered span
+  static void Clear();
+
+  // Called by TraceSpan
+  static void Record(const char* name, int64_t frame, int64_t begin_us, int64_t end_us);
+  static int64_t NowUs();
+};
+
+// Records the time until the end of the scope. A negative frame inherits the
+// frame of the enclosing span on the same thread, e.g. "decode" inside "load".
+class TraceSpan {
+ public:
+  TraceSpan(const char* name, int64_t frame);
+  ~TraceSpan();
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  // For spans whose frame is only known at the end, e.g. a received packet
+  void SetFrame(int64_t frame);
+
+ private:
+  const char* name_;
+  int64_t     frame_;
+  int64_t     outer_frame_;
+  int64_t     begin_us_;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#if ENABLE_TRACE
+#define TRACE_FRAME_SPAN(name, frame) TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(name, frame)
+#define TRACE_SPAN(name) TRACE_FRAME_SPAN(name, -1)
+// Named span whose frame is filled in later with TRACE_SET_FRAME()
+#define TRACE_NAMED_SPAN(var, name) TraceSpan var(name, -1)
+#define TRACE_SET_FRAME(var, frame) var.SetFrame(frame)
+#else
+#define TRACE_FRAME_SPAN(name, frame) ((void)0)
+#define TRACE_SPAN(name) ((void)0)
+#define TRACE_NAMED_SPAN(var, name) ((void)0)
+#define TRACE_SET_FRAME(var, frame) ((void)0)
+#endif
+
+#endif /* TRACE_H */
@@ -0,0 +1,97 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+
+WorkerPool::WorkerPool(unsigned threads) : stop_(false) {
+    if (threads == 0) {
+        unsigned cores = std::thread::hardware_concurrency();
+        threads = cores > 1 ? cores - 1 : 1;
+    }
+    threads_.reserve(threads);
+    for (unsigned i = 0; i < threads; ++i) {
+        threads_.emplace_back(&WorkerPool::WorkerLoop, this);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto &thread : threads_) {
+        thread.join();
+    }
+}
+
+WorkerPool &WorkerPool::Shared() {
+    static WorkerPool pool;
+    return pool;
+}
+
+void WorkerPool::RunTasks(Job &job) {
+    int index;
+    while ((index = job.next.fetch_add(1)) < job.count) {
+        job.task(job.fn, index);
+        job.done.fetch_add(1);
+    }
+}
+
+void WorkerPool::WorkerLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        work_cv_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+        if (stop_) {
+            return;
+        }
+
+        Job *job = jobs_.front();
+        if (job->next.load() >= job->count) {
+            // Every task is claimed, the owner waits for the ones still running
+            jobs_.pop_front();
+            continue;
+        }
+        ++job->workers;
+        lock.unlock();
+        RunTasks(*job);
+        lock.lock();
+        // The owner may free the job as soon as the last worker lets go of it
+        if (--job->workers == 0 && job->done.load() == job->count) {
+            done_cv_.notify_all();
+        }
+    }
+}
+
+void WorkerPool::Run(int count, Task task, const void *fn) {
+    if (count <= 0) {
+        return;
+    }
+    if (count == 1 || threads_.empty()) {
+        for (int i = 0; i < count; ++i) {
+            task(fn, i);
+        }
+        return;
+    }
+
+    Job job;
+    job.task = task;
+    job.fn = fn;
+    job.count = count;
+    job.next = 0;
+    job.done = 0;
+    job.workers = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(&job);
+    }
+    work_cv_.notify_all();
+
+    RunTasks(job);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [&job] { return job.done.load() == job.count && job.workers == 0; });
+    auto it = std::find(jobs_.begin(), jobs_.end(), &job);
+    if (it != jobs_.end()) {
+        jobs_.erase(it);
+    }
+}
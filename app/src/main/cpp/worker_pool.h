@@ -0,0 +1,64 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for data-parallel work such as converting a
+// frame in horizontal bands. ParallelFor() may be called from several
+// threads at once (e.g. one per encoder), their jobs share the workers.
+// The calling thread works on its own job too, so a pool of N threads
+// gives N + 1 way parallelism and a job never waits for a free worker.
+class WorkerPool {
+ public:
+  // threads == 0 picks one less than the number of cores
+  explicit WorkerPool(unsigned threads = 0);
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  // Runs fn(0) .. fn(count - 1) across the pool, returns when all are done.
+  // fn is called through a plain function pointer, not a std::function, so
+  // a call allocates nothing whatever the lambda captures.
+  template <typename Fn>
+  void ParallelFor(int count, const Fn& fn) {
+    Run(count, [](const void* f, int index) { (*static_cast<const Fn*>(f))(index); }, &fn);
+  }
+
+  // Threads available to a job, the caller included
+  int Concurrency() const { return static_cast<int>(threads_.size()) + 1; }
+
+  // Process-wide pool, created on first use
+  static WorkerPool& Shared();
+
+ private:
+  using Task = void (*)(const void* fn, int index);
+
+  struct Job {
+    Task             task;
+    const void*      fn;
+    int              count;
+    std::atomic<int> next;
+    std::atomic<int> done;
+    int              workers;  // Pool threads inside RunTasks(), guarded by mutex_
+  };
+
+  void Run(int count, Task task, const void* fn);
+  void WorkerLoop();
+  // Claims and runs tasks of job until none are left
+  void RunTasks(Job& job);
+
+  std::vector<std::thread> threads_;
+  std::deque<Job*>         jobs_;
+  std::mutex               mutex_;
+  std::condition_variable  work_cv_;
+  std::condition_variable  done_cv_;
+  bool                     stop_;
+};
+
+#endif /* WORKER_POOL_H */